@@ -2,56 +2,121 @@
 // This is free and unencumbered software released into the public domain.
 
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE
 
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#endif
+
+// Batched execution needs io_uring with renameat and unlinkat (Linux 5.11)
+#if defined(IORING_FEAT_NATIVE_WORKERS) && defined(SYS_io_uring_setup)
+#define HAVE_URING 1
+#endif
 
 #include "vidir.c"
 
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+// Address space reserved for the arena. Pages are committed as the arena
+// grows, so the reservation costs nothing until it is used.
+#define ARENA_RESERVE ((iz)1 << (sizeof(iz) > 4 ? 40 : 30))
+
+enum { DIRBUF_SIZE = 1 << 22 };  // bytes of directory entries read per call
+enum { MAX_THREADS = 64 };
+
 struct os {
     i32 temp_fd;      // File descriptor for temporary file
     u8 *temp_path;    // Path to temporary file
     i32 temp_path_len;
+    u8 *temp_map;     // Edited temp file, mapped by os_map_temp_file
+    iz  temp_map_len;
+    i32 journal_fd;   // fd 4, open once os_open_journal succeeds
+    b32 journal_err;  // a journal write failed, so it cannot be synced
+    oscounters calls; // Counted for --stats
+    iz  committed;    // Arena bytes committed so far
+    u8 *dirbuf;       // DIRBUF_SIZE buffer for os_list_dir, allocated on use
+    struct dirslot_ *dirs;  // DIRCACHE_SIZE parent directories, allocated on use
+    struct uring_ *ring;    // for os_run_batch, set up on first use
+    b32 ring_failed;        // io_uring unavailable, run actions one by one
+    b32 parallel;           // inside os_parallel: no dircache, no ring
 };
 
-static s8 cuthead(s8 s, iz off) {
-    assert(off >= 0);
-    assert(off <= s.len);
-    s.s += off;
-    s.len -= off;
-    return s;
-}
-
 static u8 *tocstr(arena *a, s8 s)
 {
-    u8 *z = new(a, u8, s.len + 1);
+    u8 *z = newnz(a, u8, s.len + 1);
     memcpy(z, s.s, (size_t)s.len);
     z[s.len] = 0;
     return z;
 }
 
+// Reserve up to cap bytes of address space, settling for less when the
+// system refuses (e.g. a ulimit on virtual memory).
 static arena newarena_(os *ctx, iz cap)
 {
     arena a = {0};
-    a.beg = malloc((size_t)cap);
+    for (; cap >= ARENA_GRAIN; cap /= 2) {
+        void *p = mmap(0, (size_t)cap, PROT_NONE,
+                       MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if (p != MAP_FAILED) {
+            a.beg = p;
+            break;
+        }
+    }
     if (!a.beg) {
         os_write(ctx, 2, S("vidir: failed to allocate memory\n"));
         os_exit(ctx, 1);
     }
-    a.end = a.beg + cap;
+    a.end = a.beg;
+    a.limit = a.beg + cap;
     a.ctx = ctx;
     return a;
 }
 
+// Make reserved pages usable. Large sessions also ask for transparent huge
+// pages, which cuts TLB misses when walking multi-gigabyte tables.
+static b32 os_commit(os *ctx, byte *beg, iz len)
+{
+    uz page = (uz)sysconf(_SC_PAGESIZE);
+    byte *start = (byte *)((uz)beg & -page);
+    len += beg - start;
+    if (mprotect(start, (size_t)len, PROT_READ|PROT_WRITE)) {
+        return 0;
+    }
+    iz committed = __atomic_add_fetch(&ctx->committed, len, __ATOMIC_RELAXED);
+    #ifdef MADV_HUGEPAGE
+    if (committed >= (iz)1<<26) {
+        madvise(start, (size_t)len, MADV_HUGEPAGE);
+    }
+    #endif
+    return 1;
+}
+
 static config *newconfig_(os *ctx, i32 argc, u8 **argv)
 {
-    arena perm = newarena_(ctx, 1<<26);
+    arena perm = newarena_(ctx, ARENA_RESERVE);
     config *conf = new(&perm, config, 1);
     
     if (argc > 1) {
@@ -75,14 +140,20 @@ static config *newconfig_(os *ctx, i32 argc, u8 **argv)
 static void os_write(os *ctx, i32 fd, s8 s)
 {
     assert(ctx);
-    assert(fd > 0 && fd <= 3);
+    assert(fd > 0 && fd <= 4);
     
-    // Map fd 3 to our temp file descriptor
+    // Map fd 3 to our temp file descriptor, and 4 to the journal
     i32 actual_fd = (fd == 3) ? ctx->temp_fd : fd;
+    actual_fd = (fd == 4) ? ctx->journal_fd : actual_fd;
     
     while (s.len) {
         iz written = write(actual_fd, s.s, (size_t)s.len);
-        if (written < 0) {
+        if (written < 0 && errno == EINTR) {
+            continue;
+        } else if (written < 0) {
+            if (fd == 4) {
+                __atomic_store_n(&ctx->journal_err, 1, __ATOMIC_RELAXED);
+            }
             return;  // Write error, silently fail
         }
         s = cuthead(s, written);
@@ -106,42 +177,231 @@ static i32 os_read(os *ctx, i32 fd, u8 *buf, i32 len)
     return (i32)nread;
 }
 
-static b32 os_path_is_dir(os *ctx, arena scratch, s8 path)
+static i32 modetype_(mode_t mode)
+{
+    if (S_ISREG(mode)) return FT_FILE;
+    if (S_ISDIR(mode)) return FT_DIR;
+    if (S_ISLNK(mode)) return FT_LINK;
+    return FT_OTHER;
+}
+
+#ifdef DT_UNKNOWN
+static i32 dtype_(u8 type)
+{
+    switch (type) {
+    case DT_UNKNOWN: return FT_UNKNOWN;
+    case DT_REG:     return FT_FILE;
+    case DT_DIR:     return FT_DIR;
+    case DT_LNK:     return FT_LINK;
+    }
+    return FT_OTHER;
+}
+#endif
+
+// Type of the file a path refers to, following symlinks, or FT_UNKNOWN
+// if it does not exist.
+static i32 os_path_type(os *ctx, arena scratch, s8 path)
 {
     assert(ctx);
     assert(path.s);
-    (void)ctx;
     
     u8 *cstr = tocstr(&scratch, path);
     struct stat st;
+    oscount(ctx->calls.stat);
     if (stat((char *)cstr, &st) != 0) {
-        return 0;
+        return FT_UNKNOWN;
+    }
+    return modetype_(st.st_mode);
+}
+
+// Descriptors for recently used parent directories, so operations hand the
+// kernel a basename instead of having it walk the full path every time.
+// Direct mapped: a colliding directory replaces the old one, which bounds
+// the number of descriptors held open.
+enum { DIRCACHE_SIZE = 256 };
+
+typedef struct dirslot_ {
+    u8 *path;  // malloc'd copy, null when empty
+    iz  len;
+    i32 fd;
+} dirslot_;
+
+// Close every cached descriptor. A descriptor follows its directory when
+// it moves, so anything that renames or removes a directory (or a symbolic
+// link that may lead to one) must forget them.
+static void dircache_flush_(os *ctx)
+{
+    for (i32 i = 0; ctx->dirs && i < DIRCACHE_SIZE; i++) {
+        dirslot_ *slot = ctx->dirs + i;
+        if (slot->path) {
+            close(slot->fd);
+            free(slot->path);
+            slot->path = 0;
+        }
     }
-    return S_ISDIR(st.st_mode);
+}
+
+// Resolve path to a directory descriptor and a name relative to it. Falls
+// back to the whole path against the working directory when the parent
+// cannot be opened, so failures surface from the operation itself. The
+// descriptor keep, still needed by the caller, is never evicted.
+static i32 dirat_(os *ctx, arena *scratch, s8 path, u8 **name, i32 keep)
+{
+    iz slash = path.len - 1;
+    for (; slash >= 0 && path.s[slash] != '/'; slash--) {}
+    s8 base = cuthead(path, slash + 1);
+    if (slash < 0 || !base.len) {
+        *name = tocstr(scratch, path);
+        return AT_FDCWD;
+    }
+    *name = tocstr(scratch, base);
+    if (slash == 1 && path.s[0] == '.') {
+        return AT_FDCWD;  // "./name", as every listing entry starts
+    }
+    if (ctx->parallel) {
+        // The cache is not shared between threads
+        *name = tocstr(scratch, path);
+        return AT_FDCWD;
+    }
+
+    if (!ctx->dirs) {
+        ctx->dirs = calloc(DIRCACHE_SIZE, sizeof(dirslot_));
+    }
+    s8 dir = {path.s, slash ? slash : 1};  // "/name" lives in "/"
+    dirslot_ *slot = ctx->dirs ? ctx->dirs + (s8hash(dir) & (DIRCACHE_SIZE-1)) : 0;
+    if (slot && slot->path && s8equals((s8){slot->path, slot->len}, dir)) {
+        return slot->fd;
+    }
+
+    if (slot && slot->path && slot->fd == keep) {
+        slot = 0;
+    }
+    i32 fd = slot ? open((char *)tocstr(scratch, dir), O_RDONLY|O_DIRECTORY|O_CLOEXEC) : -1;
+    u8 *copy = fd < 0 ? 0 : malloc((size_t)dir.len);
+    if (!copy) {
+        if (fd >= 0) close(fd);
+        *name = tocstr(scratch, path);
+        return AT_FDCWD;
+    }
+    if (slot->path) {
+        close(slot->fd);
+        free(slot->path);
+    }
+    memcpy(copy, dir.s, (size_t)dir.len);
+    slot->path = copy;
+    slot->len = dir.len;
+    slot->fd = fd;
+    return fd;
 }
 
 static b32 os_path_exists(os *ctx, arena scratch, s8 path)
 {
     assert(ctx);
     assert(path.s);
-    (void)ctx;
     
-    u8 *cstr = tocstr(&scratch, path);
+    // A dangling symlink still occupies its name
+    u8 *name;
+    i32 dirfd = dirat_(ctx, &scratch, path, &name, -1);
     struct stat st;
-    return stat((char *)cstr, &st) == 0;
+    oscount(ctx->calls.stat);
+    return fstatat(dirfd, (char *)name, &st, AT_SYMLINK_NOFOLLOW) == 0;
 }
 
-static s8node *os_list_dir(os *ctx, arena *perm, s8 path)
+static b32 isdots_(char *name)
 {
-    assert(ctx);
-    assert(perm);
-    assert(path.s);
-    (void)ctx;
-    
-    arena scratch = *perm;
-    u8 *cstr = tocstr(&scratch, path);
-    DIR *dir = opendir((char *)cstr);
-    if (!dir) {
+    return name[0]=='.' && (!name[1] || (name[1]=='.' && !name[2]));
+}
+
+// The prefix shared by the entries of directory path: path itself when it
+// already ends in a separator, otherwise a copy with one appended
+static s8 dirprefix_(arena *perm, s8 path)
+{
+    if (!path.len || path.s[path.len-1] == '/') {
+        return path;
+    }
+    s8 r = {newnz(perm, u8, path.len+1), path.len+1};
+    memcpy(r.s, path.s, (size_t)path.len);
+    r.s[path.len] = '/';
+    return r;
+}
+
+// Copy name to *text and point node at it under dir, advancing *text
+static void fill_entry_(s8node *node, u8 **text, s8 *dir, char *name, i32 type)
+{
+    iz len = (iz)strlen(name);
+    u8 *p = *text;
+    memcpy(p, name, (size_t)len);
+    node->str = (s8){p, len};
+    node->dir = dir;
+    node->next = 0;
+    node->type = type;
+    *text = p + len;
+}
+
+#ifdef __linux__
+// Record layout returned by getdents64(2)
+typedef struct {
+    u64            ino;
+    i64            off;
+    unsigned short reclen;
+    u8             type;
+    char           name[];
+} kdirent;
+
+// Read the directory in large batches straight from the kernel, building
+// each batch's nodes and names as two contiguous blocks.
+static s8node *list_getdents_(oscounters *calls, arena *perm, s8 *dir, i32 fd, u8 *buf)
+{
+    s8node *head = 0;
+    s8node **tail = &head;
+
+    for (;;) {
+        calls->readdir++;
+        long n = syscall(SYS_getdents64, fd, buf, DIRBUF_SIZE);
+        if (n <= 0) break;
+
+        iz count = 0;
+        iz bytes = 0;
+        for (long off = 0; off < n;) {
+            kdirent *d = (kdirent *)(buf + off);
+            off += d->reclen;
+            if (isdots_(d->name)) continue;
+            count++;
+            bytes += (iz)strlen(d->name);
+        }
+
+        s8node *nodes = newnz(perm, s8node, count);
+        u8 *text = newnz(perm, u8, bytes);
+        for (long off = 0; off < n;) {
+            kdirent *d = (kdirent *)(buf + off);
+            off += d->reclen;
+            if (isdots_(d->name)) continue;
+            fill_entry_(nodes, &text, dir, d->name, dtype_(d->type));
+            *tail = nodes;
+            tail = &nodes->next;
+            nodes++;
+        }
+    }
+    return head;
+}
+#endif
+
+// List the open directory fd, whose entries are named under dir, a
+// prefix from dirprefix_. The descriptor stays open. buf, when available,
+// enables batched reads.
+static s8node *list_fd_(oscounters *calls, arena *perm, s8 *dir, i32 fd, u8 *buf)
+{
+    #ifdef __linux__
+    if (buf) {
+        return list_getdents_(calls, perm, dir, fd, buf);
+    }
+    #endif
+    (void)buf;
+
+    i32 copy = dup(fd);  // closedir closes the descriptor
+    DIR *dirp = copy < 0 ? 0 : fdopendir(copy);
+    if (!dirp) {
+        if (copy >= 0) close(copy);
         return 0;
     }
     
@@ -149,45 +409,324 @@ static s8node *os_list_dir(os *ctx, arena *perm, s8 path)
     s8node **tail = &head;
     
     struct dirent *entry;
-    while ((entry = readdir(dir)) != 0) {
-        s8 name = s8fromcstr((u8 *)entry->d_name);
-        
+    while (calls->readdir++, (entry = readdir(dirp)) != 0) {
         // Skip "." and ".."
-        if (name.len == 1 && name.s[0] == '.') continue;
-        if (name.len == 2 && name.s[0] == '.' && name.s[1] == '.') continue;
+        if (isdots_(entry->d_name)) continue;
         
-        // Build full path: path + "/" + name
-        iz separator_needed = (path.len > 0 && path.s[path.len-1] != '/') ? 1 : 0;
-        iz full_len = path.len + separator_needed + name.len;
-        
-        u8 *full_path = new(perm, u8, full_len);
-        iz pos = 0;
-        
-        // Copy directory path
-        for (iz i = 0; i < path.len; i++) {
-            full_path[pos++] = path.s[i];
-        }
-        
-        // Add separator if needed
-        if (separator_needed) {
-            full_path[pos++] = '/';
-        }
-        
-        // Copy filename
-        for (iz i = 0; i < name.len; i++) {
-            full_path[pos++] = name.s[i];
-        }
-        
-        // Create node with full path
-        s8node *node = new(perm, s8node, 1);
-        node->str = (s8){full_path, full_len};
-        node->next = 0;
+        iz len = (iz)strlen(entry->d_name);
+        u8 *text = newnz(perm, u8, len);
+        s8node *node = newnz(perm, s8node, 1);
+        i32 type = FT_UNKNOWN;
+        #ifdef DT_UNKNOWN
+        type = dtype_(entry->d_type);
+        #endif
+        fill_entry_(node, &text, dir, entry->d_name, type);
         
         *tail = node;
         tail = &node->next;
     }
     
-    closedir(dir);
+    closedir(dirp);
+    return head;
+}
+
+static s8node *os_list_dir(os *ctx, arena *perm, s8 path)
+{
+    assert(ctx);
+    assert(perm);
+    assert(path.s);
+    
+    arena scratch = *perm;
+    u8 *cstr = tocstr(&scratch, path);
+
+    #ifdef __linux__
+    if (!ctx->dirbuf) {
+        ctx->dirbuf = malloc(DIRBUF_SIZE);
+    }
+    #endif
+
+    i32 fd = open((char *)cstr, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    s8 *dir = new(perm, s8, 1);
+    *dir = dirprefix_(perm, path);
+    s8node *head = list_fd_(&ctx->calls, perm, dir, fd, ctx->dirbuf);
+    close(fd);
+    return head;
+}
+
+// Recursive listing runs on a pool of workers. Each owns a stack of
+// directories waiting to be read: it pushes and pops at the top, keeping
+// its own walk depth-first with few descriptors open, while idle workers
+// steal from the bottom, where the largest unexplored subtrees tend to be.
+// Directories are opened with openat relative to their parent's descriptor
+// so the kernel never resolves a full path twice.
+typedef struct walkdir_ walkdir_;
+struct walkdir_ {
+    walkdir_ *prev;    // toward the top of the owner's stack
+    walkdir_ *next;    // toward the bottom
+    walkdir_ *parent;  // open directory to resolve name in, or null
+    s8        path;    // full path
+    s8        prefix;  // shared by every entry, from dirprefix_
+    s8        name;    // relative to parent
+    i32       fd;
+    i32       refs;    // this directory plus children not yet opened
+    i32       depth;   // depth of this directory's entries
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    walkdir_       *top;
+    walkdir_       *bottom;
+    arena           perm;
+    oscounters      calls;
+    s8node         *head;
+    s8node        **tail;
+    u8             *buf;
+} walker_;
+
+typedef struct {
+    walker_        *workers;
+    i32             nworkers;
+    i32             maxdepth;
+    iz              pending;  // directories queued or being read
+    iz              queued;   // directories waiting on some stack
+    i32             idle;     // workers asleep on wake
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;     // something queued, or nothing pending
+} walk_;
+
+static void walk_push_(walker_ *w, walkdir_ *d)
+{
+    pthread_mutex_lock(&w->lock);
+    d->prev = 0;
+    d->next = w->top;
+    if (w->top) {
+        w->top->prev = d;
+    } else {
+        w->bottom = d;
+    }
+    w->top = d;
+    pthread_mutex_unlock(&w->lock);
+}
+
+static walkdir_ *walk_pop_(walker_ *w, b32 steal)
+{
+    pthread_mutex_lock(&w->lock);
+    walkdir_ *d = steal ? w->bottom : w->top;
+    if (d && steal) {
+        w->bottom = d->prev;
+        if (w->bottom) {
+            w->bottom->next = 0;
+        } else {
+            w->top = 0;
+        }
+    } else if (d) {
+        w->top = d->next;
+        if (w->top) {
+            w->top->prev = 0;
+        } else {
+            w->bottom = 0;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return d;
+}
+
+// Wake one idle worker, or all of them, if any are asleep. Sleepers check
+// the counters under the lock, so a change made before this is never missed.
+static void walk_wake_(walk_ *walk, b32 all)
+{
+    if (__atomic_load_n(&walk->idle, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&walk->lock);
+        if (all) {
+            pthread_cond_broadcast(&walk->wake);
+        } else {
+            pthread_cond_signal(&walk->wake);
+        }
+        pthread_mutex_unlock(&walk->lock);
+    }
+}
+
+static void walk_release_(walkdir_ *d)
+{
+    if (!__atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL)) {
+        close(d->fd);
+    }
+}
+
+// Read one directory, append its entries to the worker's results and
+// queue its subdirectories.
+static void walk_read_(walk_ *walk, walker_ *self, walkdir_ *d)
+{
+    arena scratch = self->perm;
+    i32 flags = O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC;
+    i32 fd;
+    if (d->parent) {
+        fd = openat(d->parent->fd, (char *)tocstr(&scratch, d->name), flags);
+        walk_release_(d->parent);
+    } else {
+        // The root was named by the user, so follow it if it is a link
+        fd = open((char *)tocstr(&scratch, d->path), flags & ~O_NOFOLLOW);
+    }
+    if (fd < 0) {
+        return;  // listed as empty, like os_list_dir
+    }
+
+    s8node *entries = list_fd_(&self->calls, &self->perm, &d->prefix, fd, self->buf);
+    d->fd = fd;
+    d->refs = 1;
+    b32 descend = !walk->maxdepth || d->depth < walk->maxdepth;
+    iz queued = 0;
+
+    for (s8node *e = entries; e; e = e->next) {
+        s8 name = e->str;
+        if (e->type == FT_UNKNOWN && descend) {
+            scratch = self->perm;
+            struct stat sb;
+            self->calls.stat++;
+            if (!fstatat(fd, (char *)tocstr(&scratch, name), &sb, AT_SYMLINK_NOFOLLOW)) {
+                e->type = modetype_(sb.st_mode);
+            }
+        }
+        if (e->type == FT_DIR && descend) {
+            walkdir_ *c = new(&self->perm, walkdir_, 1);
+            c->parent = d;
+            c->prefix = (s8){0, d->prefix.len + name.len + 1};
+            c->prefix.s = newnz(&self->perm, u8, c->prefix.len);
+            memcpy(c->prefix.s, d->prefix.s, (size_t)d->prefix.len);
+            memcpy(c->prefix.s + d->prefix.len, name.s, (size_t)name.len);
+            c->prefix.s[c->prefix.len-1] = '/';
+            c->path = (s8){c->prefix.s, c->prefix.len - 1};
+            c->name = name;
+            c->fd = -1;
+            c->depth = d->depth + 1;
+            __atomic_add_fetch(&d->refs, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&walk->pending, 1, __ATOMIC_RELAXED);
+            walk_push_(self, c);
+            __atomic_add_fetch(&walk->queued, 1, __ATOMIC_SEQ_CST);
+            queued++;
+        }
+        *self->tail = e;
+        self->tail = &e->next;
+    }
+    walk_release_(d);
+    if (queued) {
+        walk_wake_(walk, queued > 1);
+    }
+}
+
+static void walk_worker_(void *arg, i32 id)
+{
+    walk_ *walk = arg;
+    walker_ *self = walk->workers + id;
+    for (;;) {
+        walkdir_ *d = walk_pop_(self, 0);
+        for (i32 i = 1; !d && i < walk->nworkers; i++) {
+            d = walk_pop_(walk->workers + (id + i)%walk->nworkers, 1);
+        }
+        if (d) {
+            __atomic_sub_fetch(&walk->queued, 1, __ATOMIC_SEQ_CST);
+            walk_read_(walk, self, d);
+            if (!__atomic_sub_fetch(&walk->pending, 1, __ATOMIC_SEQ_CST)) {
+                walk_wake_(walk, 1);
+            }
+            continue;
+        }
+
+        // Sleep until another worker queues a directory or the walk ends,
+        // rather than spin while one thread reads a deep, narrow tree
+        pthread_mutex_lock(&walk->lock);
+        __atomic_add_fetch(&walk->idle, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&walk->pending, __ATOMIC_SEQ_CST) &&
+               __atomic_load_n(&walk->queued, __ATOMIC_SEQ_CST) <= 0) {
+            pthread_cond_wait(&walk->wake, &walk->lock);
+        }
+        __atomic_sub_fetch(&walk->idle, 1, __ATOMIC_SEQ_CST);
+        b32 done = !__atomic_load_n(&walk->pending, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&walk->lock);
+        if (done) {
+            return;
+        }
+    }
+}
+
+static s8node *os_walk_dir(os *ctx, arena *perm, s8 path, i32 maxdepth)
+{
+    walk_ walk = {0};
+    walk.maxdepth = maxdepth;
+    walk.pending = 1;
+    walk.queued = 1;
+    pthread_mutex_init(&walk.lock, 0);
+    pthread_cond_init(&walk.wake, 0);
+
+    walkdir_ *root = new(perm, walkdir_, 1);
+    root->path = path;
+    root->prefix = dirprefix_(perm, path);
+    root->fd = -1;
+    root->depth = 1;
+
+    i32 n = os_ncpu(ctx);
+    walk.workers = new(perm, walker_, n);
+    arena subs[MAX_THREADS];
+    n = arena_split(perm, subs, n);
+    walk.nworkers = n;
+
+    #ifdef __linux__
+    if (!ctx->dirbuf) {
+        ctx->dirbuf = malloc(DIRBUF_SIZE);
+    }
+    #endif
+    for (i32 i = 0; i < n; i++) {
+        walker_ *w = walk.workers + i;
+        pthread_mutex_init(&w->lock, 0);
+        w->perm = subs[i];
+        w->tail = &w->head;
+        #ifdef __linux__
+        w->buf = i ? malloc(DIRBUF_SIZE) : ctx->dirbuf;
+        #endif
+    }
+    walk_push_(walk.workers, root);
+
+    os_parallel(ctx, n, walk_worker_, &walk);
+
+    s8node *head = 0;
+    s8node **tail = &head;
+    for (i32 i = 0; i < n; i++) {
+        walker_ *w = walk.workers + i;
+        if (w->head) {
+            *tail = w->head;
+            tail = w->tail;
+        }
+        ctx->calls.readdir += w->calls.readdir;
+        ctx->calls.stat += w->calls.stat;
+        if (i) free(w->buf);
+        pthread_mutex_destroy(&w->lock);
+        subs[i] = w->perm;
+    }
+    pthread_cond_destroy(&walk.wake);
+    pthread_mutex_destroy(&walk.lock);
+
+    // Pack the results down so the arena keeps its whole reservation.
+    // Entries of one directory are adjacent and share its prefix, whose
+    // text moves once, with the first of them.
+    iz shift[MAX_THREADS];
+    arenapack pk = arena_pack_plan(subs, n, shift);
+    s8 *lastdir = 0;
+    for (s8node *e = head; e;) {
+        s8node *next = e->next;
+        if (e->dir != lastdir) {
+            lastdir = e->dir;
+            e->dir->s = arena_packed(&pk, e->dir->s);
+        }
+        e->dir = arena_packed(&pk, e->dir);
+        e->str.s = arena_packed(&pk, e->str.s);
+        e->next = arena_packed(&pk, next);
+        e = next;
+    }
+    head = arena_packed(&pk, head);
+    arena_pack(perm, subs, n, &pk);
     return head;
 }
 
@@ -204,7 +743,7 @@ static void os_create_temp_file(os *ctx, arena *perm)
     s8 suf = S("/vidirXXXXXX");
     
     ctx->temp_path_len = dir.len + suf.len;
-    ctx->temp_path = new(perm, u8, ctx->temp_path_len + 1);
+    ctx->temp_path = newnz(perm, u8, ctx->temp_path_len + 1);
     
     for (iz i = 0; i < dir.len; i++) {
         ctx->temp_path[i] = dir.s[i];
@@ -229,17 +768,103 @@ static void os_close_temp_file(os *ctx)
     }
 }
 
-static void os_open_temp_file(os *ctx)
+// Contents of fd, mapped read-only when it is a non-empty regular file
+// and otherwise read whole into perm. Null on a read error.
+static s8 map_fd_(arena *perm, i32 fd, b32 *mapped)
 {
-    if (ctx->temp_fd >= 0) {
-        close(ctx->temp_fd);
+    struct stat st;
+    *mapped = 0;
+    if (!fstat(fd, &st) && st.st_size > 0 && st.st_size <= ARENA_RESERVE) {
+        void *p = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            *mapped = 1;
+            return (s8){p, (iz)st.st_size};
+        }
     }
-    
-    ctx->temp_fd = open((char *)ctx->temp_path, O_RDONLY);
-    if (ctx->temp_fd < 0) {
+
+    // Empty or unmappable: read it whole, doubling the buffer as needed
+    s8 r = {0};
+    iz cap = 1 << 12;
+    r.s = newnz(perm, u8, cap);
+    for (;;) {
+        if (r.len == cap) {
+            u8 *s = newnz(perm, u8, cap*2);
+            for (iz i = 0; i < r.len; i++) {
+                s[i] = r.s[i];
+            }
+            r.s = s;
+            cap *= 2;
+        }
+        iz n = read(fd, r.s + r.len, (size_t)(cap - r.len));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return (s8){0};
+        } else if (!n) {
+            break;
+        }
+        r.len += n;
+    }
+    return r;
+}
+
+static s8 os_map_temp_file(os *ctx, arena *perm)
+{
+    os_close_temp_file(ctx);
+    i32 fd = open((char *)ctx->temp_path, O_RDONLY);
+    if (fd < 0) {
         os_write(ctx, 2, S("vidir: failed to open temporary file\n"));
         os_exit(ctx, 1);
     }
+
+    b32 mapped;
+    s8 r = map_fd_(perm, fd, &mapped);
+    close(fd);
+    if (!r.s) {
+        os_write(ctx, 2, S("vidir: failed to read temporary file\n"));
+        os_exit(ctx, 1);
+    } else if (mapped) {
+        ctx->temp_map = r.s;
+        ctx->temp_map_len = r.len;
+    }
+    return r;
+}
+
+// Contents of the file at path, left mapped until exit. Null if it
+// cannot be opened or read.
+static s8 os_read_file(os *ctx, arena *perm, s8 path)
+{
+    (void)ctx;
+    arena scratch = *perm;
+    i32 fd = open((char *)tocstr(&scratch, path), O_RDONLY);
+    if (fd < 0) {
+        return (s8){0};
+    }
+    b32 mapped;
+    s8 r = map_fd_(perm, fd, &mapped);
+    close(fd);
+    return r;
+}
+
+// Create or truncate the file at path and fill it with data
+static b32 os_write_file(os *ctx, arena scratch, s8 path, s8 data)
+{
+    (void)ctx;
+    i32 fd = open((char *)tocstr(&scratch, path), O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0) {
+        return 0;
+    }
+    while (data.len) {
+        iz n = write(fd, data.s, (size_t)data.len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            close(fd);
+            return 0;
+        }
+        data = cuthead(data, n);
+    }
+    return !close(fd);
 }
 
 static void os_remove_temp_file(os *ctx)
@@ -248,6 +873,12 @@ static void os_remove_temp_file(os *ctx)
         close(ctx->temp_fd);
         ctx->temp_fd = -1;
     }
+
+    if (ctx->temp_map) {
+        munmap(ctx->temp_map, (size_t)ctx->temp_map_len);
+        ctx->temp_map = 0;
+        ctx->temp_map_len = 0;
+    }
     
     if (ctx->temp_path_len > 0) {
         unlink((char *)ctx->temp_path);
@@ -255,6 +886,35 @@ static void os_remove_temp_file(os *ctx)
     }
 }
 
+static b32 os_open_journal(os *ctx, arena scratch, s8 path, b32 create)
+{
+    i32 flags = O_WRONLY | O_APPEND | (create ? O_CREAT|O_EXCL : 0);
+    u8 *cpath = tocstr(&scratch, path);
+    i32 fd = open((char *)cpath, flags, 0666);
+    if (fd < 0) {
+        return 0;
+    }
+    ctx->journal_fd = fd;
+
+    // A new journal's name must survive a crash along with its contents
+    if (create) {
+        iz len = path.len;
+        for (; len > 0 && cpath[len-1] != '/'; len--) {}
+        s8 dir = len ? takehead(path, len) : S(".");
+        i32 dirfd = open((char *)tocstr(&scratch, dir), O_RDONLY);
+        if (dirfd >= 0) {
+            fsync(dirfd);
+            close(dirfd);
+        }
+    }
+    return 1;
+}
+
+static b32 os_sync_journal(os *ctx)
+{
+    return !__atomic_load_n(&ctx->journal_err, __ATOMIC_RELAXED) && !fsync(ctx->journal_fd);
+}
+
 #ifndef DEFAULT_EDITOR
 #define DEFAULT_EDITOR "vi"
 #endif
@@ -283,7 +943,7 @@ static b32 os_invoke_editor(os *ctx, arena scratch)
     
     // Allocate buffer for full command from scratch arena
     iz total = ed.len + space.len + temp.len + 1;
-    char *full_cmd = (char *)new(&scratch, u8, total);
+    char *full_cmd = (char *)newnz(&scratch, u8, total);
     
     iz pos = 0;
     for (iz i = 0; i < ed.len; i++) full_cmd[pos++] = (char)ed.s[i];
@@ -326,79 +986,300 @@ static b32 os_invoke_editor(os *ctx, arena scratch)
     return WEXITSTATUS(status) == 0;
 }
 
-static b32 os_delete_path(os *ctx, arena scratch, s8 path)
+static b32 os_delete_path(os *ctx, arena scratch, s8 path, i32 type)
 {
     assert(ctx);
     assert(path.s);
-    (void)ctx;
     
-    u8 *cstr = tocstr(&scratch, path);
+    u8 *name;
+    i32 dirfd = dirat_(ctx, &scratch, path, &name, -1);
     
-    // Try to remove as file first, then as directory
-    if (unlink((char *)cstr) == 0) {
-        return 1;
+    // Only look at the file when the listing could not say what it is
+    if (type == FT_UNKNOWN) {
+        struct stat st;
+        oscount(ctx->calls.stat);
+        if (fstatat(dirfd, (char *)name, &st, AT_SYMLINK_NOFOLLOW)) {
+            return 0;
+        }
+        type = modetype_(st.st_mode);
     }
-    if (rmdir((char *)cstr) == 0) {
-        return 1;
+
+    if (type == FT_DIR) {
+        oscount(ctx->calls.rmdir);
+        b32 ok = unlinkat(dirfd, (char *)name, AT_REMOVEDIR) == 0;
+        dircache_flush_(ctx);
+        return ok;
     }
-    return 0;
+    oscount(ctx->calls.unlink);
+    return unlinkat(dirfd, (char *)name, 0) == 0;
 }
 
 static b32 os_create_dir(os *ctx, arena scratch, s8 path)
 {
     assert(ctx);
     assert(path.s);
-    (void)ctx;
     
-    u8 *cstr = tocstr(&scratch, path);
-    
-    // Check if directory already exists
-    struct stat st;
-    if (stat((char *)cstr, &st) == 0 && S_ISDIR(st.st_mode)) {
-        return 1;  // Already exists and is a directory
+    // Usually the directory already exists, or only it is missing
+    {
+        arena temp = scratch;
+        u8 *name;
+        i32 dirfd = dirat_(ctx, &temp, path, &name, -1);
+        struct stat st;
+        oscount(ctx->calls.stat);
+        if (fstatat(dirfd, (char *)name, &st, 0) == 0) {
+            return S_ISDIR(st.st_mode);
+        }
+        oscount(ctx->calls.mkdir);
+        if (mkdirat(dirfd, (char *)name, 0777) == 0) {
+            return 1;
+        } else if (errno == EEXIST) {
+            // Another job may have just created it
+            oscount(ctx->calls.stat);
+            return fstatat(dirfd, (char *)name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        } else if (errno != ENOENT) {
+            return 0;
+        }
     }
     
-    // Create directories iteratively by null-terminating at each slash
-    for (iz i = 0; i < path.len; i++) {
+    // Ancestors are missing too: create them top-down in one pass, letting
+    // mkdir report the ones that already exist
+    u8 *cstr = tocstr(&scratch, path);
+    for (iz i = 1; i < path.len; i++) {
         if (cstr[i] == '/') {
-            u8 saved = cstr[i];
             cstr[i] = 0;
-            
-            // Skip empty path components
-            if (i > 0) {
-                if (stat((char *)cstr, &st) != 0) {
-                    // Directory doesn't exist, create it
-                    if (mkdir((char *)cstr, 0777) != 0) {
-                        return 0;  // Failed to create
-                    }
-                } else if (!S_ISDIR(st.st_mode)) {
-                    return 0;  // Exists but is not a directory
-                }
+            oscount(ctx->calls.mkdir);
+            if (mkdir((char *)cstr, 0777) != 0 && errno != EEXIST) {
+                return 0;  // Failed to create
             }
-            
-            cstr[i] = saved;  // Restore the slash
+            cstr[i] = '/';  // Restore the slash
         }
     }
-    
-    // Create final directory if it doesn't exist
-    if (stat((char *)cstr, &st) != 0) {
-        return mkdir((char *)cstr, 0777) == 0;
+    oscount(ctx->calls.mkdir);
+    if (mkdir((char *)cstr, 0777) == 0) {
+        return 1;
     }
-    
-    return S_ISDIR(st.st_mode);
+    struct stat st;
+    oscount(ctx->calls.stat);
+    return errno == EEXIST && stat((char *)cstr, &st) == 0 && S_ISDIR(st.st_mode);
 }
 
-static b32 os_rename_file(os *ctx, arena scratch, s8 src, s8 dst)
+static b32 os_rename_file(os *ctx, arena scratch, s8 src, s8 dst, i32 type)
 {
     assert(ctx);
     assert(src.s);
     assert(dst.s);
-    (void)ctx;
     
-    u8 *src_cstr = tocstr(&scratch, src);
-    u8 *dst_cstr = tocstr(&scratch, dst);
+    u8 *src_name, *dst_name;
+    i32 src_fd = dirat_(ctx, &scratch, src, &src_name, -1);
+    i32 dst_fd = dirat_(ctx, &scratch, dst, &dst_name, src_fd);
     
-    return rename((char *)src_cstr, (char *)dst_cstr) == 0;
+    oscount(ctx->calls.rename);
+    b32 ok = renameat(src_fd, (char *)src_name, dst_fd, (char *)dst_name) == 0;
+    if (type != FT_FILE && type != FT_OTHER) {
+        dircache_flush_(ctx);
+    }
+    return ok;
+}
+
+#ifdef HAVE_URING
+enum { URING_ENTRIES = 1024 };
+enum { URING_RETRIES = 16 };  // failed waits in a row before giving up
+
+typedef struct uring_ {
+    i32                  fd;
+    u32                 *sq_head;
+    u32                 *sq_tail;
+    u32                 *sq_mask;
+    u32                 *sq_array;
+    u32                 *cq_head;
+    u32                 *cq_tail;
+    u32                 *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    u32                  entries;
+} uring_;
+
+// Set up a ring whose kernel supports the operations batches use
+static uring_ *uring_open_(void)
+{
+    struct io_uring_params p = {0};
+    i32 fd = (i32)syscall(SYS_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0) {
+        return 0;
+    }
+
+    enum { PROBE_OPS = 256 };
+    struct io_uring_probe *probe = calloc(1, sizeof(*probe) +
+                                          PROBE_OPS*sizeof(probe->ops[0]));
+    b32 supported = probe &&
+        !syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, probe, PROBE_OPS) &&
+        probe->last_op >= IORING_OP_UNLINKAT &&
+        probe->ops[IORING_OP_RENAMEAT].flags & IO_URING_OP_SUPPORTED &&
+        probe->ops[IORING_OP_UNLINKAT].flags & IO_URING_OP_SUPPORTED;
+    free(probe);
+
+    uring_ *r = supported ? calloc(1, sizeof(*r)) : 0;
+    if (!r) {
+        close(fd);
+        return 0;
+    }
+
+    size_t sqlen = p.sq_off.array + p.sq_entries*sizeof(u32);
+    size_t cqlen = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sqlen = cqlen = sqlen > cqlen ? sqlen : cqlen;
+    }
+    byte *sq = mmap(0, sqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                    fd, IORING_OFF_SQ_RING);
+    byte *cq = sq;
+    if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(0, cqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                  fd, IORING_OFF_CQ_RING);
+    }
+    void *sqes = MAP_FAILED;
+    if (sq != MAP_FAILED && cq != MAP_FAILED) {
+        sqes = mmap(0, p.sq_entries*sizeof(struct io_uring_sqe),
+                    PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                    fd, IORING_OFF_SQES);
+    }
+    if (sqes == MAP_FAILED) {
+        close(fd);  // the mappings go away with the process
+        free(r);
+        return 0;
+    }
+
+    r->fd       = fd;
+    r->sq_head  = (u32 *)(sq + p.sq_off.head);
+    r->sq_tail  = (u32 *)(sq + p.sq_off.tail);
+    r->sq_mask  = (u32 *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (u32 *)(sq + p.sq_off.array);
+    r->cq_head  = (u32 *)(cq + p.cq_off.head);
+    r->cq_tail  = (u32 *)(cq + p.cq_off.tail);
+    r->cq_mask  = (u32 *)(cq + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->sqes     = sqes;
+    r->entries  = p.sq_entries;
+    return r;
+}
+
+// Submit ops[0, n), n no more than the ring holds, and wait for them all.
+// Returns 0 if the kernel would not take them.
+// Record posted completions in ops, returning how many there were
+static u32 uring_reap_(uring_ *r, osop *ops)
+{
+    u32 head = *r->cq_head;
+    u32 end = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    u32 count = end - head;
+    for (; head != end; head++) {
+        struct io_uring_cqe *cqe = r->cqes + (head & *r->cq_mask);
+        ops[cqe->user_data].ok = cqe->res >= 0;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+// Run ops on the ring and wait for all of them. If the ring fails, what
+// it never took is withdrawn and 0 returned, with ok set only for those
+// known to have succeeded. Others may still be in flight.
+static b32 uring_run_(os *ctx, uring_ *r, arena scratch, osop *ops, u32 n)
+{
+    u32 tail = *r->sq_tail;
+    for (u32 k = 0; k < n; k++) {
+        osop *op = ops + k;
+        u32 idx = (tail + k) & *r->sq_mask;
+        struct io_uring_sqe *sqe = r->sqes + idx;
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uz)tocstr(&scratch, op->src);
+        sqe->user_data = k;
+        op->ok = 0;
+        if (op->dst.len) {
+            sqe->opcode = IORING_OP_RENAMEAT;
+            sqe->len = (u32)AT_FDCWD;
+            sqe->addr2 = (uz)tocstr(&scratch, op->dst);
+            oscount(ctx->calls.rename);
+        } else if (op->type == FT_DIR) {
+            sqe->opcode = IORING_OP_UNLINKAT;
+            sqe->unlink_flags = AT_REMOVEDIR;
+            oscount(ctx->calls.rmdir);
+        } else {
+            sqe->opcode = IORING_OP_UNLINKAT;
+            oscount(ctx->calls.unlink);
+        }
+        r->sq_array[idx] = idx;
+    }
+    __atomic_store_n(r->sq_tail, tail + n, __ATOMIC_RELEASE);
+
+    u32 submitted = 0;
+    u32 completed = 0;
+    for (i32 errors = 0; completed < n;) {
+        long rc = syscall(SYS_io_uring_enter, r->fd, n - submitted,
+                          n - completed, IORING_ENTER_GETEVENTS, 0, 0);
+        if (rc < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            if (submitted && ++errors < URING_RETRIES) {
+                continue;  // wait for what is already in flight
+            }
+            // Withdraw the entries so the ring stays consistent
+            __atomic_store_n(r->sq_tail, tail + submitted, __ATOMIC_RELEASE);
+            uring_reap_(r, ops);
+            return 0;
+        }
+        errors = 0;
+        submitted += rc > 0 ? (u32)rc : 0;
+        completed += uring_reap_(r, ops);
+    }
+    return 1;
+}
+#endif
+
+static b32 os_run_batch(os *ctx, arena scratch, osop *ops, iz n)
+{
+    #ifdef HAVE_URING
+    if (ctx->parallel) {
+        return 0;  // one ring, shared by no one
+    }
+    if (!ctx->ring && !ctx->ring_failed) {
+        ctx->ring = uring_open_();
+        ctx->ring_failed = !ctx->ring;
+    }
+    if (ctx->ring) {
+        b32 flush = 0;
+        for (iz i = 0; i < n;) {
+            u32 len = n - i < ctx->ring->entries ? (u32)(n - i) : ctx->ring->entries;
+            if (!uring_run_(ctx, ctx->ring, scratch, ops + i, len)) {
+                // Late completions would be taken for a later batch's, so
+                // the ring is dropped, and the ordinary way finishes what
+                // it did not. Anything still in flight then fails here.
+                close(ctx->ring->fd);
+                ctx->ring = 0;
+                ctx->ring_failed = 1;
+                for (iz j = i; j < n; j++) {
+                    osop *op = ops + j;
+                    if (j < i+len && op->ok) {
+                        continue;
+                    }
+                    op->ok = op->dst.len
+                        ? os_rename_file(ctx, scratch, op->src, op->dst, op->type)
+                        : os_delete_path(ctx, scratch, op->src, op->type);
+                }
+                break;
+            }
+            i += len;
+        }
+        for (iz i = 0; i < n; i++) {
+            flush |= ops[i].type != FT_FILE && ops[i].type != FT_OTHER;
+        }
+        if (flush) {
+            dircache_flush_(ctx);
+        }
+        return 1;
+    }
+    #endif
+    (void)ctx;
+    (void)scratch;
+    (void)ops;
+    (void)n;
+    return 0;
 }
 
 static void os_exit(os *ctx, i32 code)
@@ -407,6 +1288,63 @@ static void os_exit(os *ctx, i32 code)
     exit(code);
 }
 
+static i64 os_clock(os *ctx)
+{
+    (void)ctx;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (i64)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static oscounters *os_counters(os *ctx)
+{
+    return &ctx->calls;
+}
+
+static i32 os_ncpu(os *ctx)
+{
+    (void)ctx;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n > MAX_THREADS ? MAX_THREADS : (i32)n;
+}
+
+typedef struct {
+    void (*fn)(void *, i32);
+    void *arg;
+    i32   id;
+} thread_;
+
+static void *thread_main_(void *arg)
+{
+    thread_ *t = arg;
+    t->fn(t->arg, t->id);
+    return 0;
+}
+
+static void os_parallel(os *ctx, i32 n, void (*fn)(void *, i32), void *arg)
+{
+    n = n < 1 ? 1 : n > MAX_THREADS ? MAX_THREADS : n;
+    if (n > 1) {
+        dircache_flush_(ctx);
+        ctx->parallel = 1;
+    }
+    thread_   threads[MAX_THREADS];
+    pthread_t handles[MAX_THREADS];
+    b32       started[MAX_THREADS] = {0};
+    for (i32 i = 1; i < n; i++) {
+        threads[i] = (thread_){fn, arg, i};
+        // On failure the remaining threads pick up the work
+        started[i] = !pthread_create(handles+i, 0, thread_main_, threads+i);
+    }
+    fn(arg, 0);
+    for (i32 i = 1; i < n; i++) {
+        if (started[i]) {
+            pthread_join(handles[i], 0);
+        }
+    }
+    ctx->parallel = 0;
+}
+
 int main(int argc, char **argv)
 {
     os ctx[1] = {0};
@@ -23,13 +23,6 @@ typedef struct {
     c32 rune;
 } utf16;
 
-static s8 cuthead(s8 s, iz off) {
-    assert(off <= s.len);
-    s.s += off;
-    s.len -= off;
-    return s;
-}
-
 static s16 s16cuthead_(s16 s, iz off) {
     assert(off >= 0);
     assert(off <= s.len);
@@ -159,7 +152,7 @@ static s16 towide_(arena *perm, s8 s)
     }
 
     s16 w = {0};
-    w.s = new(perm, c16, len + 1);  // +1 for null terminator
+    w.s = newnz(perm, c16, len + 1);  // +1 for null terminator
     state.tail = s;
     while (state.tail.len) {
         state = utf8decode_(state.tail);
@@ -181,7 +174,7 @@ static s8 fromwide_(arena *perm, s16 w)
     }
 
     s8 s = {0};
-    s.s = new(perm, u8, len);
+    s.s = newnz(perm, u8, len);
     state.tail = w;
     while (state.tail.len) {
         state = utf16decode_(state.tail);
@@ -192,29 +185,44 @@ static s8 fromwide_(arena *perm, s16 w)
 
 // For communication with os_write()
 struct os {
-    // 4 handles: stdin stdout stderr tempfile
+    // 5 handles: stdin stdout stderr tempfile journal
     struct {
         iptr h;
         b32  isconsole;
         b32  err;
-    } handles[4];
+    } handles[5];
     
     c16 *temp_file_path_w;  // UTF-16 path to temp file
+    byte *temp_view;        // Edited temp file, mapped by os_map_temp_file
+    oscounters calls;       // Counted for --stats
 };
 
+// Address space reserved for the arena, committed as it grows
+#define ARENA_RESERVE ((iz)1 << (sizeof(iz) > 4 ? 40 : 29))
+
+// Reserve up to cap bytes of address space, settling for less if needed
 static arena newarena_(os *ctx, iz cap)
 {
     arena arena = {0};
-    arena.beg = VirtualAlloc(0, cap, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
+    for (; cap >= ARENA_GRAIN; cap /= 2) {
+        arena.beg = VirtualAlloc(0, cap, MEM_RESERVE, PAGE_NOACCESS);
+        if (arena.beg) break;
+    }
     if (!arena.beg) {
         os_write(ctx, 2, S("vidir: failed to allocate memory\n"));
         os_exit(ctx, 1);
     }
-    arena.end = arena.beg + cap;
+    arena.end = arena.beg;
+    arena.limit = arena.beg + cap;
     arena.ctx = ctx;
     return arena;
 }
 
+static b32 os_commit(os *ctx, byte *beg, iz len)
+{
+    return VirtualAlloc((uptr)beg, len, MEM_COMMIT, PAGE_READWRITE) != 0;
+}
+
 
 
 // Get environment variable as UTF-16
@@ -226,7 +234,7 @@ static s16 fromenv_w(arena *perm, c16 *name)
         return r;
     }
     
-    c16 *wbuf = new(perm, c16, wlen);
+    c16 *wbuf = newnz(perm, c16, wlen);
     GetEnvironmentVariableW(name, wbuf, wlen);
     
     return (s16){wbuf, wlen - 1};  // Exclude null terminator
@@ -234,7 +242,7 @@ static s16 fromenv_w(arena *perm, c16 *name)
 
 static config *newconfig_(os *ctx)
 {
-    arena perm = newarena_(ctx, 1<<26);
+    arena perm = newarena_(ctx, ARENA_RESERVE);
     config *conf = new(&perm, config, 1);
     conf->perm = perm;
         
@@ -294,7 +302,7 @@ static void flushconsole_(u16buf *b)
 
 static void os_write(os *ctx, i32 fd, s8 s)
 {
-    assert(fd > 0 && fd <= 3);
+    assert(fd > 0 && fd <= 4);
     if (ctx->handles[fd].err) return;
     
     if (ctx->handles[fd].isconsole) {
@@ -330,22 +338,34 @@ static i32 os_read(os *ctx, i32 fd, u8 *buf, i32 len)
     return bytesRead;
 }
 
-static b32 os_path_is_dir(os *ctx, arena scratch, s8 path)
+static i32 attrtype_(i32 attr)
+{
+    return attr & FILE_ATTRIBUTE_DIRECTORY ? FT_DIR : FT_FILE;
+}
+
+// Type of a path itself rather than its target. Junctions and symbolic
+// links are reparse points, typed as links so a walk never enters them.
+static i32 entrytype_(i32 attr)
+{
+    return attr & FILE_ATTRIBUTE_REPARSE_POINT ? FT_LINK : attrtype_(attr);
+}
+
+static i32 os_path_type(os *ctx, arena scratch, s8 path)
 {
     s16 wpath = towide_(&scratch, path);
+    oscount(ctx->calls.stat);
     i32 attr = GetFileAttributesW(wpath.s);
     
     if (attr == -1) {
-        return 0;  // Path doesn't exist or access denied
+        return FT_UNKNOWN;  // Path doesn't exist or access denied
     }
-    
-    // Check if it's a directory
-    return (attr & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    return attrtype_(attr);
 }
 
 static b32 os_path_exists(os *ctx, arena scratch, s8 path)
 {
     s16 wpath = towide_(&scratch, path);
+    oscount(ctx->calls.stat);
     i32 attr = GetFileAttributesW(wpath.s);
     
     return attr != -1;  // Path exists (file or directory)
@@ -358,10 +378,11 @@ static s8node *os_list_dir(os *ctx, arena *perm, s8 path)
     s16 wbase = towide_(&scratch, path);
     
     // Extend the allocation for search pattern "/*\0"
-    (void) new(&scratch, c16, 3);
+    (void) newnz(&scratch, c16, 3);
     
     // Append search pattern to UTF-16 string
-    if (wbase.len > 0 && wbase.s[wbase.len-1] != L'\\' && wbase.s[wbase.len-1] != L'/') {
+    b32 separator_needed = path.len > 0 && path.s[path.len-1] != '\\' && path.s[path.len-1] != '/';
+    if (separator_needed) {
         wbase.s[wbase.len++] = L'/';
     }
     wbase.s[wbase.len++] = L'*';
@@ -374,6 +395,18 @@ static s8node *os_list_dir(os *ctx, arena *perm, s8 path)
         return 0;
     }
     
+    // Every entry shares one copy of the directory, ending in a separator
+    s8 *dir = new(perm, s8, 1);
+    *dir = path;
+    if (separator_needed) {
+        dir->s = newnz(perm, u8, path.len + 1);
+        dir->len = path.len + 1;
+        for (iz i = 0; i < path.len; i++) {
+            dir->s[i] = path.s[i];
+        }
+        dir->s[path.len] = '/';
+    }
+    
     s8node *head = 0;
     s8node **tail = &head;
     
@@ -393,38 +426,48 @@ static s8node *os_list_dir(os *ctx, arena *perm, s8 path)
         
         if (!utf8_filename.len) continue;
         
-        // Build full path string once and insert directly in linked list
-        iz separator_needed = (path.len > 0 && path.s[path.len-1] != '\\' && path.s[path.len-1] != '/') ? 1 : 0;
-        iz full_len = path.len + separator_needed + utf8_filename.len;
-        
-        u8 *full_path = new(perm, u8, full_len);
-        
-        // Build the full path string
-        iz pos = 0;
-        for (iz i = 0; i < path.len; i++) {
-            full_path[pos++] = path.s[i];
-        }
-        if (separator_needed) {
-            full_path[pos++] = '/';
-        }
-        for (iz i = 0; i < utf8_filename.len; i++) {
-            full_path[pos++] = utf8_filename.s[i];
-        }
-        
         // Insert directly in linked list
         s8node *node = new(perm, s8node, 1);
-        node->str = (s8){full_path, full_len};
-        node->next = 0;
+        node->dir = dir;
+        node->str = utf8_filename;
+        node->type = entrytype_(fd.attr);
         
         *tail = node;
         tail = &node->next;
         
-    } while (FindNextFileW(handle, &fd));
+    } while (oscount(ctx->calls.readdir), FindNextFileW(handle, &fd));
     
     FindClose(handle);
     return head;
 }
 
+// Walk one level at a time. Directory handles cannot be opened relative to
+// one another here, so there is nothing to gain from a thread pool.
+static s8node *os_walk_dir(os *ctx, arena *perm, s8 path, i32 maxdepth)
+{
+    s8node *head = 0;
+    s8node **tail = &head;
+    s8node *level = os_list_dir(ctx, perm, path);
+    for (i32 depth = 1; level; depth++) {
+        s8node *next = 0;
+        s8node **next_tail = &next;
+        for (s8node *n = level; n; n = n->next) {
+            if (n->type == FT_DIR && (!maxdepth || depth < maxdepth)) {
+                *next_tail = os_list_dir(ctx, perm, s8node_path(n, perm));
+                while (*next_tail) {
+                    next_tail = &(*next_tail)->next;
+                }
+            }
+        }
+        *tail = level;
+        while (*tail) {
+            tail = &(*tail)->next;
+        }
+        level = next;
+    }
+    return head;
+}
+
 // Create a temp file, and open "file descriptor 3" with it
 // NOTE: MAX_PATH hardcoded buffer uses here are okay.
 // GetTempPathW documents:
@@ -450,7 +493,7 @@ static void os_create_temp_file(os *ctx, arena *perm)
     i32 path_len = 0;
     while (temp_file[path_len]) path_len++;
     
-    ctx->temp_file_path_w = new(perm, c16, path_len + 1);
+    ctx->temp_file_path_w = newnz(perm, c16, path_len + 1);
     for (i32 i = 0; i <= path_len; i++) {  // Include null terminator
         ctx->temp_file_path_w[i] = temp_file[i];
     }
@@ -484,31 +527,126 @@ static void os_close_temp_file(os *ctx)
     }
 }
 
-// Open for reading
-static void os_open_temp_file(os *ctx)
+// Contents of an open handle, viewed read-only when it is non-empty and
+// otherwise read whole into perm. Null on a read error.
+static s8 map_handle_(arena *perm, iptr h, byte **view)
 {
-    if (!ctx->temp_file_path_w) {
-        ctx->handles[3].err = 1;
-        return;
+    // The view keeps the file open after both handles are closed
+    i64 size = 0;
+    *view = 0;
+    if (GetFileSizeEx(h, &size) && size > 0 && size <= ARENA_RESERVE) {
+        iptr m = CreateFileMappingW(h, 0, PAGE_READONLY, 0, 0, 0);
+        *view = m ? MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0) : 0;
+        if (m) {
+            CloseHandle(m);
+        }
+        if (*view) {
+            return (s8){(u8 *)*view, (iz)size};
+        }
     }
-    
-    ctx->handles[3].h = CreateFileW(
+
+    // Empty or unmappable: read it whole, doubling the buffer as needed
+    s8 r = {0};
+    iz cap = 1 << 12;
+    r.s = newnz(perm, u8, cap);
+    for (;;) {
+        if (r.len == cap) {
+            u8 *s = newnz(perm, u8, cap*2);
+            for (iz i = 0; i < r.len; i++) {
+                s[i] = r.s[i];
+            }
+            r.s = s;
+            cap *= 2;
+        }
+        i32 max = cap - r.len > 1<<30 ? 1<<30 : (i32)(cap - r.len);
+        i32 n = 0;
+        if (!ReadFile(h, r.s + r.len, max, &n, 0)) {
+            return (s8){0};
+        } else if (!n) {
+            break;
+        }
+        r.len += n;
+    }
+    return r;
+}
+
+// Map the edited temp file, or read it whole when it cannot be mapped
+static s8 os_map_temp_file(os *ctx, arena *perm)
+{
+    os_close_temp_file(ctx);
+    iptr h = CreateFileW(
         ctx->temp_file_path_w,
         GENERIC_READ,
-        0,
+        FILE_SHARE_READ,
         0,
         OPEN_EXISTING,
         FILE_ATTRIBUTE_TEMPORARY,
         0
     );
-    
-    if (ctx->handles[3].h == INVALID_HANDLE_VALUE) {
+    if (h == INVALID_HANDLE_VALUE) {
         os_write(ctx, 2, S("vidir: failed to open temp file for reading\n"));
         os_exit(ctx, 1);
     }
-    
-    ctx->handles[3].isconsole = 0;
-    ctx->handles[3].err = 0;
+
+    s8 r = map_handle_(perm, h, &ctx->temp_view);
+    CloseHandle(h);
+    if (!r.s) {
+        os_write(ctx, 2, S("vidir: failed to read temp file\n"));
+        os_exit(ctx, 1);
+    }
+    return r;
+}
+
+// Contents of the file at path, left mapped until exit. Null if it
+// cannot be opened or read.
+static s8 os_read_file(os *ctx, arena *perm, s8 path)
+{
+    (void)ctx;
+    arena scratch = *perm;
+    s16 wpath = towide_(&scratch, path);
+    iptr h = CreateFileW(
+        wpath.s,
+        GENERIC_READ,
+        FILE_SHARE_ALL,  // a journal is opened again to append to it
+        0,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        0
+    );
+    if (h == INVALID_HANDLE_VALUE) {
+        return (s8){0};
+    }
+    byte *view;
+    s8 r = map_handle_(perm, h, &view);
+    CloseHandle(h);
+    return r;
+}
+
+// Create or truncate the file at path and fill it with data
+static b32 os_write_file(os *ctx, arena scratch, s8 path, s8 data)
+{
+    (void)ctx;
+    s16 wpath = towide_(&scratch, path);
+    iptr h = CreateFileW(
+        wpath.s,
+        GENERIC_WRITE,
+        0,
+        0,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        0
+    );
+    if (h == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+    b32 ok = 1;
+    while (ok && data.len) {
+        i32 max = data.len > 1<<30 ? 1<<30 : (i32)data.len;
+        i32 n = 0;
+        ok = WriteFile(h, data.s, max, &n, 0);
+        data = cuthead(data, n);
+    }
+    return CloseHandle(h) && ok;
 }
 
 // Remove temp file from filesystem
@@ -519,6 +657,12 @@ static void os_remove_temp_file(os *ctx)
         CloseHandle(ctx->handles[3].h);
         ctx->handles[3].h = INVALID_HANDLE_VALUE;
     }
+
+    // A mapped file cannot be deleted
+    if (ctx->temp_view) {
+        UnmapViewOfFile(ctx->temp_view);
+        ctx->temp_view = 0;
+    }
     
     if (ctx->temp_file_path_w) {
         DeleteFileW(ctx->temp_file_path_w);
@@ -526,6 +670,29 @@ static void os_remove_temp_file(os *ctx)
 }
 
 
+// Journal writes append whole, whichever thread makes them
+static b32 os_open_journal(os *ctx, arena scratch, s8 path, b32 create)
+{
+    s16 wpath = towide_(&scratch, path);
+    ctx->handles[4].h = CreateFileW(
+        wpath.s,
+        FILE_APPEND_DATA,
+        FILE_SHARE_READ,
+        0,
+        create ? CREATE_NEW : OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        0
+    );
+    ctx->handles[4].isconsole = 0;
+    ctx->handles[4].err = 0;
+    return ctx->handles[4].h != INVALID_HANDLE_VALUE;
+}
+
+static b32 os_sync_journal(os *ctx)
+{
+    return !ctx->handles[4].err && FlushFileBuffers(ctx->handles[4].h);
+}
+
 #ifndef DEFAULT_EDTIOR
 #define DEFAULT_EDITOR L"notepad"
 #endif
@@ -562,7 +729,7 @@ static b32 os_invoke_editor(os *ctx, arena scratch)
                     1 +                            // closing quote for -c
                     1;                             // null terminator
     
-    c16 *cmdline = new(&scratch, c16, total_len);
+    c16 *cmdline = newnz(&scratch, c16, total_len);
     i32 pos = 0;
     
     // Copy "busybox sh "
@@ -645,21 +812,33 @@ static b32 os_invoke_editor(os *ctx, arena scratch)
 }
 
 // Delete a file or directory
-static b32 os_delete_path(os *ctx, arena scratch, s8 path)
+static b32 os_delete_path(os *ctx, arena scratch, s8 path, i32 type)
 {
     s16 wpath = towide_(&scratch, path);
     
-    // Check if it's a directory
-    i32 attr = GetFileAttributesW(wpath.s);
-    if (attr == -1) {
-        return 0;  // File doesn't exist
+    // Check if it's a directory, unless the listing already said
+    if (type == FT_UNKNOWN) {
+        oscount(ctx->calls.stat);
+        i32 attr = GetFileAttributesW(wpath.s);
+        if (attr == -1) {
+            return 0;  // File doesn't exist
+        }
+        type = entrytype_(attr);
     }
     
-    if (attr & FILE_ATTRIBUTE_DIRECTORY) {
+    if (type == FT_DIR) {
+        oscount(ctx->calls.rmdir);
+        return RemoveDirectoryW(wpath.s) != 0;
+    }
+    oscount(ctx->calls.unlink);
+    if (DeleteFileW(wpath.s)) {
+        return 1;
+    } else if (type == FT_LINK) {
+        // A link to a directory is removed as one, leaving its target
+        oscount(ctx->calls.rmdir);
         return RemoveDirectoryW(wpath.s) != 0;
-    } else {
-        return DeleteFileW(wpath.s) != 0;
     }
+    return 0;
 }
 
 // Create directories recursively (mkdir -p)
@@ -668,6 +847,7 @@ static b32 os_create_dir(os *ctx, arena scratch, s8 path)
     s16 wpath = towide_(&scratch, path);
     
     // Check if directory already exists
+    oscount(ctx->calls.stat);
     i32 attr = GetFileAttributesW(wpath.s);
     if (attr != -1 && (attr & FILE_ATTRIBUTE_DIRECTORY)) {
         return 1;  // Already exists and is a directory
@@ -681,11 +861,17 @@ static b32 os_create_dir(os *ctx, arena scratch, s8 path)
             
             // Skip empty path components and drive letters
             if (i > 0 && !(i == 2 && wpath.s[1] == L':')) {
+                oscount(ctx->calls.stat);
                 attr = GetFileAttributesW(wpath.s);
                 if (attr == -1) {
                     // Directory doesn't exist, create it
+                    oscount(ctx->calls.mkdir);
                     if (!CreateDirectoryW(wpath.s, 0)) {
-                        return 0;  // Failed to create
+                        // Another job may have just created it
+                        attr = GetFileAttributesW(wpath.s);
+                        if (attr == -1 || !(attr & FILE_ATTRIBUTE_DIRECTORY)) {
+                            return 0;  // Failed to create
+                        }
                     }
                 } else if (!(attr & FILE_ATTRIBUTE_DIRECTORY)) {
                     return 0;  // Exists but is not a directory
@@ -697,29 +883,103 @@ static b32 os_create_dir(os *ctx, arena scratch, s8 path)
     }
     
     // Create final directory if it doesn't exist
+    oscount(ctx->calls.stat);
     attr = GetFileAttributesW(wpath.s);
     if (attr == -1) {
-        return CreateDirectoryW(wpath.s, 0) != 0;
+        oscount(ctx->calls.mkdir);
+        if (CreateDirectoryW(wpath.s, 0)) {
+            return 1;
+        }
+        attr = GetFileAttributesW(wpath.s);  // perhaps created by another job
+        return attr != -1 && (attr & FILE_ATTRIBUTE_DIRECTORY);
     }
     
     return (attr & FILE_ATTRIBUTE_DIRECTORY) != 0;
 }
 
 // Rename/move a file or directory
-static b32 os_rename_file(os *ctx, arena scratch, s8 src, s8 dst)
+static b32 os_rename_file(os *ctx, arena scratch, s8 src, s8 dst, i32 type)
 {
+    (void)type;
     s16 wsrc = towide_(&scratch, src);
     s16 wdst = towide_(&scratch, dst);
     
+    oscount(ctx->calls.rename);
     return MoveFileW(wsrc.s, wdst.s) != 0;
 }
 
+// Operations run one at a time through os_rename_file and os_delete_path
+static b32 os_run_batch(os *ctx, arena scratch, osop *ops, iz n)
+{
+    (void)ctx;
+    (void)scratch;
+    (void)ops;
+    (void)n;
+    return 0;
+}
+
 // Exit the program with the given exit code
 static void os_exit(os *ctx, i32 code)
 {
     ExitProcess(code);
 }
 
+// Monotonic clock in nanoseconds
+static i64 os_clock(os *ctx)
+{
+    i64 freq, ticks;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&ticks);
+    return ticks/freq*1000000000 + ticks%freq*1000000000/freq;
+}
+
+static oscounters *os_counters(os *ctx)
+{
+    return &ctx->calls;
+}
+
+enum { MAX_THREADS = 64 };
+
+static i32 os_ncpu(os *ctx)
+{
+    systeminfo info = {0};
+    GetSystemInfo(&info);
+    i32 n = (i32)info.ncpu;
+    return n < 1 ? 1 : n > MAX_THREADS ? MAX_THREADS : n;
+}
+
+typedef struct {
+    void (*fn)(void *, i32);
+    void *arg;
+    i32   id;
+} thread_;
+
+static u32 __stdcall thread_main_(void *arg)
+{
+    thread_ *t = arg;
+    t->fn(t->arg, t->id);
+    return 0;
+}
+
+static void os_parallel(os *ctx, i32 n, void (*fn)(void *, i32), void *arg)
+{
+    n = n < 1 ? 1 : n > MAX_THREADS ? MAX_THREADS : n;
+    thread_ threads[MAX_THREADS];
+    iptr    handles[MAX_THREADS] = {0};
+    for (i32 i = 1; i < n; i++) {
+        threads[i] = (thread_){fn, arg, i};
+        // On failure the remaining threads pick up the work
+        handles[i] = CreateThread(0, 0, thread_main_, threads+i, 0, 0);
+    }
+    fn(arg, 0);
+    for (i32 i = 1; i < n; i++) {
+        if (handles[i]) {
+            WaitForSingleObject(handles[i], INFINITE);
+            CloseHandle(handles[i]);
+        }
+    }
+}
+
 
 #if 1
 __attribute((force_align_arg_pointer))
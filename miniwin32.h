@@ -5,6 +5,7 @@
 // Platform-specific types (basic types come from vidir.c)
 typedef ptrdiff_t       iptr;
 typedef size_t          uptr;
+typedef unsigned short  u16;
 typedef unsigned short  char16_t;
 typedef char16_t        c16;
 
@@ -12,10 +13,14 @@ enum {
     CP_UTF8 = 65001,
 
     CREATE_ALWAYS = 2,
+    CREATE_NEW = 1,
 
+    FILE_APPEND_DATA = 4,
     FILE_ATTRIBUTE_DIRECTORY = 0x10,
     FILE_ATTRIBUTE_NORMAL = 0x80,
+    FILE_ATTRIBUTE_REPARSE_POINT = 0x400,
     FILE_ATTRIBUTE_TEMPORARY = 0x100,
+    FILE_MAP_READ = 4,
     FILE_SHARE_READ = 1,
     FILE_SHARE_ALL = 7,
 
@@ -30,6 +35,8 @@ enum {
 
     OPEN_EXISTING = 3,
 
+    PAGE_NOACCESS  = 1,
+    PAGE_READONLY  = 2,
     PAGE_READWRITE = 4,
 
     STD_INPUT_HANDLE  = -10,
@@ -71,30 +78,53 @@ typedef struct {
     i32 dwThreadId;
 } processinfo;
 
+typedef struct {
+    u16 arch;
+    u16 reserved;
+    u32 pagesize;
+    byte *minaddr;
+    byte *maxaddr;
+    uptr activemask;
+    u32 ncpu;
+    u32 cputype;
+    u32 granularity;
+    u16 level;
+    u16 revision;
+} systeminfo;
+
 #define W32(r) __declspec(dllimport) r __stdcall
 W32(b32)    CloseHandle(iptr);
 W32(c16 **) CommandLineToArgvW(c16 *, i32 *);
 W32(b32)    CreateDirectoryW(c16 *, uptr);
 W32(i32)    CreateFileW(c16 *, i32, i32, uptr, i32, i32, i32);
+W32(iptr)   CreateFileMappingW(iptr, uptr, i32, i32, i32, c16 *);
+W32(iptr)   CreateThread(uptr, iz, u32 (__stdcall *)(void *), void *, i32, u32 *);
 W32(b32)    CreateProcessW(c16 *, c16 *, uptr, uptr, b32, i32, uptr, c16 *, startupinfo *, processinfo *);
 W32(b32)    DeleteFileW(c16 *);
 W32(void)   ExitProcess(i32);
 W32(b32)    FindClose(iptr);
 W32(iptr)   FindFirstFileW(c16 *, finddata *);
 W32(b32)    FindNextFileW(iptr, finddata *);
+W32(b32)    FlushFileBuffers(iptr);
 W32(c16 *)  GetCommandLineW(void);
 W32(b32)    GetConsoleMode(iptr, i32 *);
 W32(i32)    GetEnvironmentVariableW(c16 *, c16 *, i32);
 W32(b32)    GetExitCodeProcess(iptr, i32 *);
 W32(i32)    GetFileAttributesW(c16 *);
+W32(b32)    GetFileSizeEx(iptr, i64 *);
 W32(i32)    GetModuleFileNameW(iptr, c16 *, i32);
+W32(void)   GetSystemInfo(systeminfo *);
 W32(iptr)   GetStdHandle(i32);
 W32(i32)    GetTempFileNameW(c16 *, c16 *, i32, c16 *);
 W32(i32)    GetTempPathW(i32, c16 *);
+W32(byte *) MapViewOfFile(iptr, i32, i32, i32, iz);
 W32(b32)    MoveFileW(c16 *, c16 *);
+W32(b32)    QueryPerformanceCounter(i64 *);
+W32(b32)    QueryPerformanceFrequency(i64 *);
 W32(b32)    ReadFile(iptr, u8 *, i32, i32 *, uptr);
 W32(b32)    RemoveDirectoryW(c16 *);
 W32(b32)    SetStdHandle(i32, iptr);
+W32(b32)    UnmapViewOfFile(void *);
 W32(byte *) VirtualAlloc(uptr, iz, i32, i32);
 W32(i32)    WaitForSingleObject(iptr, i32);
 W32(b32)    WriteConsoleW(iptr, c16 *, i32, i32 *, uptr);
@@ -0,0 +1,364 @@
+// Phase benchmark for vidir (POSIX only)
+// This is free and unencumbered software released into the public domain.
+//
+// Builds synthetic directories and times each phase of a vidir session
+// separately: listing, sorting, temp file serialization, parsing, planning
+// and execution. The editor step is a scripted, non-interactive editor in
+// the style of tests/test_vidir.py, and its time is reported separately.
+//
+// Build and run from the repository root:
+//   cc -O2 -pthread -o bench tests/bench_vidir.c
+//   ./bench --sizes=1000,100000 --shapes=flat,deep
+
+#define main vidir_main_
+#include "../main_posix.c"
+#undef main
+
+#include <errno.h>
+#include <time.h>
+
+enum {
+    SHAPE_FLAT,     // all files in one directory
+    SHAPE_DEEP,     // all files in one directory eight levels down
+    SHAPE_SUBDIRS,  // files spread across sqrt(n) sibling directories
+    SHAPE_LONG,     // flat, with 200-byte names
+    SHAPE_UNICODE,  // flat, with multi-byte UTF-8 names
+    SHAPE_COUNT
+};
+
+static char *shape_names[SHAPE_COUNT] = {
+    "flat", "deep", "subdirs", "long", "unicode"
+};
+
+typedef struct {
+    i64 ns[PHASE_COUNT];
+    iz  bytes[PHASE_COUNT];
+    iz  files;
+} result;
+
+static i64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (i64)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static void die(char *msg)
+{
+    fprintf(stderr, "bench: %s: %s\n", msg, strerror(errno));
+    exit(1);
+}
+
+static void touch(char *path)
+{
+    int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) die(path);
+    close(fd);
+}
+
+static void makedir(char *path)
+{
+    if (mkdir(path, 0777) && errno != EEXIST) die(path);
+}
+
+static void file_name(char *buf, int len, i32 shape, iz i)
+{
+    switch (shape) {
+    case SHAPE_LONG:
+        snprintf(buf, (size_t)len, "l%09lld_%0190d", (long long)i, 0);
+        break;
+    case SHAPE_UNICODE:
+        snprintf(buf, (size_t)len, "\xc3\xbcn\xc3\xaf\xc3\xa7\xc3\xb8"
+                 "d\xc3\xa9_\xe6\x97\xa5\xe6\x9c\xac_%09lld.txt", (long long)i);
+        break;
+    default:
+        snprintf(buf, (size_t)len, "f%09lld.txt", (long long)i);
+    }
+}
+
+// Populate the current directory and return the directories vidir would
+// be given on its command line.
+static s8node *populate(arena *perm, i32 shape, iz n)
+{
+    s8node *dirs = 0;
+    s8node **tail = &dirs;
+    char name[512];
+    char path[1024];
+
+    switch (shape) {
+    case SHAPE_DEEP: {
+        char *deep = "d1/d2/d3/d4/d5/d6/d7/d8";
+        for (char *p = deep; *p; p++) {
+            if (*p == '/') {
+                snprintf(path, sizeof(path), "%.*s", (int)(p - deep), deep);
+                makedir(path);
+            }
+        }
+        makedir(deep);
+        for (iz i = 0; i < n; i++) {
+            file_name(name, sizeof(name), shape, i);
+            snprintf(path, sizeof(path), "%s/%s", deep, name);
+            touch(path);
+        }
+        tail = s8list_append(perm, tail, s8fromcstr((u8 *)deep), FT_DIR);
+    } break;
+
+    case SHAPE_SUBDIRS: {
+        iz k = 1;
+        while (k*k < n) k++;
+        for (iz d = 0; d < k; d++) {
+            snprintf(path, sizeof(path), "s%06lld", (long long)d);
+            makedir(path);
+            iz len = (iz)strlen(path);
+            u8 *copy = newnz(perm, u8, len);
+            memcpy(copy, path, (size_t)len);
+            tail = s8list_append(perm, tail, (s8){copy, len}, FT_DIR);
+        }
+        for (iz i = 0; i < n; i++) {
+            file_name(name, sizeof(name), shape, i);
+            snprintf(path, sizeof(path), "s%06lld/%s", (long long)(i%k), name);
+            touch(path);
+        }
+    } break;
+
+    default:
+        for (iz i = 0; i < n; i++) {
+            file_name(name, sizeof(name), shape, i);
+            touch(name);
+        }
+        tail = s8list_append(perm, tail, S("."), FT_DIR);
+    }
+    return dirs;
+}
+
+// Write a fake editor script that renames every Nth entry in place
+static void write_editor(char *script, iz every)
+{
+    FILE *f = fopen(script, "w");
+    if (!f) die(script);
+    fprintf(f,
+        "import sys\n"
+        "with open(sys.argv[1], 'r', encoding='utf-8') as f:\n"
+        "    lines = f.read().split('\\n')\n"
+        "for i in range(0, len(lines), %lld):\n"
+        "    num, sep, path = lines[i].partition('\\t')\n"
+        "    if sep:\n"
+        "        head, slash, base = path.rpartition('/')\n"
+        "        lines[i] = num + sep + head + slash + 'r_' + base\n"
+        "with open(sys.argv[1], 'w', encoding='utf-8') as f:\n"
+        "    f.write('\\n'.join(lines))\n",
+        (long long)every);
+    fclose(f);
+}
+
+static void remove_tree(char *path)
+{
+    char cmd[8192];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", path);
+    if (system(cmd)) {
+        fprintf(stderr, "bench: failed to remove %s\n", path);
+    }
+}
+
+static execopts exec_opts;
+
+// Run one vidir session over the current directory, following the same
+// sequence of calls as vidir() itself.
+static result run_session(os *ctx, arena *perm, s8node *dirs)
+{
+    result r = {0};
+    byte *mark;
+    i64 t;
+
+    u8buf *out = newfdbuf(perm, 1, 4096);
+    u8buf *err = newfdbuf(perm, 2, 4096);
+    os_create_temp_file(ctx, perm);
+
+    // Listing and sorting alternate per directory, as in vidir()
+    s8node *paths_head = 0;
+    s8node **paths_tail = &paths_head;
+    iz paths_count = 0;
+    for (s8node *d = dirs; d; d = d->next) {
+        mark = perm->beg;
+        t = now_ns();
+        s8node *entries = os_list_dir(ctx, perm, d->str);
+        r.ns[PHASE_LIST] += now_ns() - t;
+        r.bytes[PHASE_LIST] += perm->beg - mark;
+
+        mark = perm->beg;
+        t = now_ns();
+        entries = s8sort_(entries, *perm);
+        r.ns[PHASE_SORT] += now_ns() - t;
+        r.bytes[PHASE_SORT] += perm->beg - mark;
+
+        for (; entries; entries = entries->next) {
+            *paths_tail = entries;
+            paths_tail = &entries->next;
+            paths_count++;
+        }
+    }
+
+    mark = perm->beg;
+    t = now_ns();
+    pathtab *paths = new_pathtab(perm);
+    listing orig = write_listing(perm, paths, paths_head, paths_count);
+    write_temp_file(perm->ctx, orig.text);
+    os_close_temp_file(ctx);
+    r.ns[PHASE_WRITE] = now_ns() - t;
+    r.bytes[PHASE_WRITE] = perm->beg - mark;
+
+    t = now_ns();
+    if (!os_invoke_editor(ctx, *perm)) {
+        fprintf(stderr, "bench: editor failed\n");
+        exit(1);
+    }
+    r.ns[PHASE_EDITOR] = now_ns() - t;
+
+    mark = perm->beg;
+    t = now_ns();
+    s8 edited = os_map_temp_file(ctx, perm);
+    changes ch = parse_temp_file(perm, paths, &orig, edited, err);
+    r.ns[PHASE_PARSE] = now_ns() - t;
+    r.bytes[PHASE_PARSE] = perm->beg - mark;
+
+    mark = perm->beg;
+    t = now_ns();
+    Plan plan = compute_plan(perm, paths, &orig, ch);
+    r.ns[PHASE_PLAN] = now_ns() - t;
+    r.bytes[PHASE_PLAN] = perm->beg - mark;
+
+    stats st = {0};
+    t = now_ns();
+    if (!execute_plan(plan, *perm, ctx, out, err, exec_opts, &st)) {
+        fprintf(stderr, "bench: execute_plan failed\n");
+        exit(1);
+    }
+    r.ns[PHASE_EXECUTE] = now_ns() - t;
+    r.bytes[PHASE_EXECUTE] = st.bytes[PHASE_EXECUTE];
+
+    os_remove_temp_file(ctx);
+    r.files = orig.len;
+    return r;
+}
+
+static void report(char *shape, iz n, result r)
+{
+    printf("%-8s %10lld files\n", shape, (long long)n);
+    printf("  %-8s %12s %14s %12s\n", "phase", "ms", "files/s", "bytes/file");
+    for (i32 p = 0; p < PHASE_COUNT; p++) {
+        double ms = (double)r.ns[p] / 1e6;
+        double rate = r.ns[p] ? (double)r.files * 1e9 / (double)r.ns[p] : 0;
+        double per = r.files ? (double)r.bytes[p] / (double)r.files : 0;
+        printf("  %-8.*s %12.2f %14.0f %12.1f\n", (int)phase_names[p].len,
+               (char *)phase_names[p].s, ms, rate, per);
+    }
+    i64 total = 0;
+    iz bytes = 0;
+    for (i32 p = 0; p < PHASE_COUNT; p++) {
+        if (p != PHASE_EDITOR) total += r.ns[p];
+        bytes += r.bytes[p];
+    }
+    printf("  %-8s %12.2f %14.0f %12.1f\n", "total", (double)total / 1e6,
+           total ? (double)r.files * 1e9 / (double)total : 0,
+           r.files ? (double)bytes / (double)r.files : 0);
+    fflush(stdout);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "usage: bench [--sizes=N,...] [--shapes=flat,deep,subdirs,long,unicode]\n"
+        "             [--dir=PATH] [--python=CMD] [--rename-every=N]\n"
+        "             [--arena=BYTES] [--batch] [--jobs=N] [--keep]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    char *sizes = "1000,10000,100000";
+    char *shapes = "flat,deep,subdirs,long,unicode";
+    char *base = ".";
+    char *python = "python3";
+    iz every = 10;
+    iz cap = ARENA_RESERVE;
+    b32 keep = 0;
+
+    for (int i = 1; i < argc; i++) {
+        char *a = argv[i];
+        if (!strncmp(a, "--sizes=", 8)) {
+            sizes = a + 8;
+        } else if (!strncmp(a, "--shapes=", 9)) {
+            shapes = a + 9;
+        } else if (!strncmp(a, "--dir=", 6)) {
+            base = a + 6;
+        } else if (!strncmp(a, "--python=", 9)) {
+            python = a + 9;
+        } else if (!strncmp(a, "--rename-every=", 15)) {
+            every = atoll(a + 15);
+        } else if (!strncmp(a, "--arena=", 8)) {
+            cap = atoll(a + 8);
+        } else if (!strcmp(a, "--batch")) {
+            exec_opts.batch = 1;
+        } else if (!strncmp(a, "--jobs=", 7)) {
+            exec_opts.jobs = atoi(a + 7);
+        } else if (!strcmp(a, "--keep")) {
+            keep = 1;
+        } else {
+            usage();
+        }
+    }
+    if (every < 1 || exec_opts.jobs < 0) usage();
+
+    if (chdir(base)) die(base);
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd))) die("getcwd");
+
+    char script[4200];
+    snprintf(script, sizeof(script), "%s/bench_editor.py", cwd);
+    write_editor(script, every);
+    char editor[4400];
+    snprintf(editor, sizeof(editor), "%s %s", python, script);
+    setenv("EDITOR", editor, 1);
+    unsetenv("VISUAL");
+
+    os ctx[1] = {0};
+    ctx->temp_fd = -1;
+    arena perm = newarena_(ctx, cap);
+
+    for (char *s = shapes; *s;) {
+        char *comma = strchr(s, ',');
+        iz len = comma ? comma - s : (iz)strlen(s);
+        i32 shape = -1;
+        for (i32 k = 0; k < SHAPE_COUNT; k++) {
+            if ((iz)strlen(shape_names[k]) == len && !strncmp(s, shape_names[k], (size_t)len)) {
+                shape = k;
+            }
+        }
+        if (shape < 0) usage();
+
+        for (char *z = sizes; *z;) {
+            iz n = atoll(z);
+            char dir[4300];
+            snprintf(dir, sizeof(dir), "%s/bench_%s_%lld", cwd, shape_names[shape], (long long)n);
+            remove_tree(dir);
+            makedir(dir);
+            if (chdir(dir)) die(dir);
+            dircache_flush_(ctx);  // descriptors from the previous session
+
+            arena scratch = perm;
+            s8node *dirs = populate(&scratch, shape, n);
+            result r = run_session(ctx, &scratch, dirs);
+            report(shape_names[shape], n, r);
+
+            if (chdir(cwd)) die(cwd);
+            if (!keep) remove_tree(dir);
+
+            char *next = strchr(z, ',');
+            z = next ? next + 1 : z + strlen(z);
+        }
+        s = comma ? comma + 1 : s + len;
+    }
+
+    unlink(script);
+    return 0;
+}
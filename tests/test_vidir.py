@@ -46,7 +46,7 @@ with open(sys.argv[1], 'w') as f:
     editor_script_unix = editor_script.replace("\\", "/")
     return f"{python_command} {editor_script_unix}"
 
-def run_vidir_test(test_name, setup_files, editor_operations, expected_files, vidir_args=None, vidir_command="vidir", python_command="python3", expected_contents=None, use_gdb=False):
+def run_vidir_test(test_name, setup_files, editor_operations, expected_files, vidir_args=None, vidir_command="vidir", python_command="python3", expected_contents=None, use_gdb=False, links=None):
     """Run a single vidir test."""
     print(f"\n=== Testing: {test_name} ===")
     
@@ -68,6 +68,10 @@ def run_vidir_test(test_name, setup_files, editor_operations, expected_files, vi
             with open(filename, "w") as f:
                 f.write(content)
         
+        # Create symbolic links, which the walk below does not follow
+        for link, target in (links or {}).items():
+            os.symlink(target, link)
+        
         # Create fake editor
         editor_cmd = create_fake_editor(".", editor_operations, python_command)
         
@@ -143,6 +147,129 @@ def run_vidir_test(test_name, setup_files, editor_operations, expected_files, vi
         if os.path.exists(test_dir):
             shutil.rmtree(test_dir)
 
+def run_apply_test(test_name, setup_files, edit_operations, expected_files, vidir_command="vidir"):
+    """List with --list-out, edit the listing here and replay it with --apply.
+    A second --apply must then refuse the listing, which no longer matches."""
+    print(f"\n=== Testing: {test_name} ===")
+    
+    test_dir = f"test_{test_name.lower().replace(' ', '_')}"
+    if os.path.exists(test_dir):
+        shutil.rmtree(test_dir)
+    os.makedirs(os.path.join(test_dir, "files"))
+    
+    try:
+        original_cwd = os.getcwd()
+        os.chdir(test_dir)
+        
+        for filename, content in setup_files.items():
+            path = os.path.join("files", filename)
+            os.makedirs(os.path.dirname(path), exist_ok=True)
+            with open(path, "w") as f:
+                f.write(content)
+        
+        # No editor may run in either step
+        env = os.environ.copy()
+        env["EDITOR"] = "false"
+        cmd = [vidir_command] if isinstance(vidir_command, str) else list(vidir_command)
+        
+        result = subprocess.run(cmd + ["--list-out", "listing.txt", "files"], env=env, capture_output=True, text=True)
+        if result.returncode != 0:
+            print(f"✗ FAIL: {test_name} - --list-out failed: {result.stderr}")
+            return False
+        
+        with open("listing.txt", "r", newline="") as f:
+            content = f.read()
+        scope = {"content": content}
+        exec(edit_operations, {}, scope)
+        with open("edited.txt", "w", newline="") as f:
+            f.write(scope["content"])
+        
+        apply = cmd + ["--list-out", "listing.txt", "--apply", "edited.txt", "files"]
+        result = subprocess.run(apply, env=env, capture_output=True, text=True)
+        print(f"Return code: {result.returncode}")
+        if result.stderr:
+            print(f"Stderr: {result.stderr}")
+        
+        actual_files = set()
+        for root, dirs, files in os.walk("files"):
+            for file in files:
+                path = os.path.relpath(os.path.join(root, file), "files")
+                actual_files.add(path.replace("\\", "/"))
+        if result.returncode != 0 or actual_files != set(expected_files):
+            print(f"✗ FAIL: {test_name} - File structure mismatch")
+            print(f"  Expected: {sorted(expected_files)}")
+            print(f"  Actual:   {sorted(actual_files)}")
+            return False
+        
+        result = subprocess.run(apply, env=env, capture_output=True, text=True)
+        if result.returncode == 0:
+            print(f"✗ FAIL: {test_name} - stale listing was applied")
+            return False
+        
+        print(f"✓ PASS: {test_name}")
+        return True
+    
+    finally:
+        os.chdir(original_cwd)
+        if os.path.exists(test_dir):
+            shutil.rmtree(test_dir)
+
+def run_journal_test(test_name, setup_files, editor_operations, expected_contents, vidir_command="vidir", python_command="python3"):
+    """Edit under --journal, then --rollback to the setup and --resume to
+    the edit again, checking every file's contents after each step."""
+    print(f"\n=== Testing: {test_name} ===")
+    
+    test_dir = f"test_{test_name.lower().replace(' ', '_')}"
+    if os.path.exists(test_dir):
+        shutil.rmtree(test_dir)
+    os.makedirs(os.path.join(test_dir, "files"))
+    
+    try:
+        original_cwd = os.getcwd()
+        os.chdir(test_dir)
+        
+        for filename, content in setup_files.items():
+            with open(os.path.join("files", filename), "w") as f:
+                f.write(content)
+        
+        env = os.environ.copy()
+        env["EDITOR"] = create_fake_editor(".", editor_operations, python_command)
+        cmd = [vidir_command] if isinstance(vidir_command, str) else list(vidir_command)
+        
+        def contents():
+            found = {}
+            for root, dirs, files in os.walk("files"):
+                for file in files:
+                    path = os.path.join(root, file)
+                    with open(path, "r") as f:
+                        found[os.path.relpath(path, "files").replace("\\", "/")] = f.read()
+            return found
+        
+        steps = [
+            (["--journal", "journal.txt", "files"], expected_contents),
+            (["--rollback", "journal.txt"], setup_files),
+            (["--resume", "journal.txt"], expected_contents),
+        ]
+        for args, expected in steps:
+            result = subprocess.run(cmd + args, env=env, capture_output=True, text=True)
+            print(f"{args[0]}: return code {result.returncode}")
+            if result.stderr:
+                print(f"Stderr: {result.stderr}")
+            actual = contents()
+            if result.returncode != 0 or actual != expected:
+                print(f"✗ FAIL: {test_name} - Mismatch after {args[0]}")
+                print(f"  Expected: {sorted(expected.items())}")
+                print(f"  Actual:   {sorted(actual.items())}")
+                return False
+        
+        print(f"✓ PASS: {test_name}")
+        return True
+    
+    finally:
+        os.chdir(original_cwd)
+        if os.path.exists(test_dir):
+            shutil.rmtree(test_dir)
+
 def main():
     """Run all vidir tests."""
     # Parse command line arguments
@@ -448,6 +575,198 @@ content = content.replace("3\\t./file3.txt", "3\\t./target.txt")
     ):
         tests_passed += 1
     
+    # Test: Recursive listing - renaming a directory carries its listed contents,
+    # even one renamed along with it, and deleting a directory and its
+    # contents removes the whole subtree, even when its name is then reused
+    tests_total += 1
+    if run_vidir_test(
+        "Recursive Rename and Delete",
+        {
+            "dir1/a.txt": "content_a",
+            "dir1/sub/b.txt": "content_b",
+            "old/x.txt": "content_x",
+            "old/deep/y.txt": "content_y",
+            "gone/x.txt": "content_gone",
+            "fresh.txt": "content_fresh",
+            "keep.txt": "content_keep"
+        },
+        '''
+content = content.replace("./dir1", "./dir9")
+content = content.replace("./dir9/a.txt", "./dir9/z.txt")
+lines = content.strip().split("\\n")
+lines = [line for line in lines if "./old" not in line and "./gone" not in line]
+content = "\\n".join(lines) + "\\n"
+content = content.replace("\\t./fresh.txt", "\\t./gone")
+        ''',
+        ["dir9/z.txt", "dir9/sub/b.txt", "gone", "keep.txt"],
+        ["--recursive", "."],
+        vidir_command,
+        python_command,
+        expected_contents={
+            "dir9/z.txt": "content_a",
+            "dir9/sub/b.txt": "content_b",
+            "gone": "content_fresh"
+        }
+    ):
+        tests_passed += 1
+    
+    # Test: Recursive listing through a symbolic link to a directory - the
+    # link named on the command line is followed, not listed as empty
+    if hasattr(os, "symlink") and os.name != "nt":
+        tests_total += 1
+        if run_vidir_test(
+            "Recursive Linked Directory",
+            {
+                "d/a.txt": "content_a",
+                "d/sub/b.txt": "content_b"
+            },
+            '''
+content = content.replace("ld/a.txt", "ld/c.txt")
+            ''',
+            ["d/c.txt", "d/sub/b.txt"],
+            ["--recursive", "ld"],
+            vidir_command,
+            python_command,
+            expected_contents={
+                "d/c.txt": "content_a"
+            },
+            links={"ld": "d"}
+        ):
+            tests_passed += 1
+    
+    # Test: Parallel execution - a swap, a rename chain into a new directory
+    # and a delete run as independent jobs
+    tests_total += 1
+    if run_vidir_test(
+        "Parallel Jobs",
+        {
+            "a.txt": "content_a",
+            "b.txt": "content_b",
+            "c.txt": "content_c",
+            "d.txt": "content_d",
+            "e.txt": "content_e"
+        },
+        '''
+content = content.replace("a.txt", "TEMP").replace("b.txt", "a.txt").replace("TEMP", "b.txt")
+content = content.replace("d.txt", "new/d.txt").replace("c.txt", "d.txt")
+lines = content.strip().split("\\n")
+lines = [line for line in lines if "e.txt" not in line]
+content = "\\n".join(lines) + "\\n"
+        ''',
+        ["a.txt", "b.txt", "d.txt", "new/d.txt"],
+        ["--jobs", "4"],
+        vidir_command,
+        python_command,
+        expected_contents={
+            "a.txt": "content_b",
+            "b.txt": "content_a",
+            "d.txt": "content_c",
+            "new/d.txt": "content_d"
+        }
+    ):
+        tests_passed += 1
+    
+    # Test: Batched execution - independent renames and deletes handed to
+    # the platform at once
+    tests_total += 1
+    if run_vidir_test(
+        "Batched Renames and Deletes",
+        {
+            "a.txt": "content_a",
+            "b.txt": "content_b",
+            "c.txt": "content_c",
+            "d.txt": "content_d",
+            "e.txt": "content_e"
+        },
+        '''
+content = content.replace("a.txt", "a2.txt").replace("b.txt", "b2.txt").replace("c.txt", "c2.txt")
+lines = content.strip().split("\\n")
+lines = [line for line in lines if "d.txt" not in line and "e.txt" not in line]
+content = "\\n".join(lines) + "\\n"
+        ''',
+        ["a2.txt", "b2.txt", "c2.txt"],
+        ["--batch"],
+        vidir_command,
+        python_command,
+        expected_contents={
+            "a2.txt": "content_a",
+            "b2.txt": "content_b",
+            "c2.txt": "content_c"
+        }
+    ):
+        tests_passed += 1
+    
+    # Test: Cycles in separate directories - each stashes beside its own
+    # files, so they can run as independent jobs
+    tests_total += 1
+    if run_vidir_test(
+        "Cycles in Subdirectories",
+        {
+            "dir1/a.txt": "content_a",
+            "dir1/b.txt": "content_b",
+            "dir2/x.txt": "content_x",
+            "dir2/y.txt": "content_y"
+        },
+        '''
+content = content.replace("a.txt", "TEMP").replace("b.txt", "a.txt").replace("TEMP", "b.txt")
+content = content.replace("x.txt", "TEMP").replace("y.txt", "x.txt").replace("TEMP", "y.txt")
+        ''',
+        ["dir1/a.txt", "dir1/b.txt", "dir2/x.txt", "dir2/y.txt"],
+        ["--jobs", "4", "dir1", "dir2"],
+        vidir_command,
+        python_command,
+        expected_contents={
+            "dir1/a.txt": "content_b",
+            "dir1/b.txt": "content_a",
+            "dir2/x.txt": "content_y",
+            "dir2/y.txt": "content_x"
+        }
+    ):
+        tests_passed += 1
+    
+    # Test: Non-interactive apply - a rename and a delete replayed from an
+    # edited listing, then refused once the files have changed
+    tests_total += 1
+    if run_apply_test(
+        "Apply Listing",
+        {
+            "a.txt": "content_a",
+            "b.txt": "content_b",
+            "c.txt": "content_c"
+        },
+        '''
+content = content.replace("a.txt", "sub/renamed.txt")
+content = "".join(line for line in content.splitlines(True) if "b.txt" not in line)
+        ''',
+        ["sub/renamed.txt", "c.txt"],
+        vidir_command
+    ):
+        tests_passed += 1
+    
+    # Test: Journal - a swap and a rename into a new directory, rolled back
+    # and then resumed from the journal alone
+    tests_total += 1
+    if run_journal_test(
+        "Journal Rollback Resume",
+        {
+            "a.txt": "content_a",
+            "b.txt": "content_b",
+            "c.txt": "content_c"
+        },
+        '''
+content = content.replace("a.txt", "TEMP").replace("b.txt", "a.txt").replace("TEMP", "b.txt")
+content = content.replace("c.txt", "sub/c.txt")
+        ''',
+        {
+            "a.txt": "content_b",
+            "b.txt": "content_a",
+            "sub/c.txt": "content_c"
+        },
+        vidir_command,
+        python_command
+    ):
+        tests_passed += 1
+    
     print(f"\n=== Test Results ===")
     print(f"Passed: {tests_passed}/{tests_total}")
     
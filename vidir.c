@@ -3,19 +3,26 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#if __AVX2__
+#  include <immintrin.h>
+#elif __SSE2__
+#  include <emmintrin.h>
+#endif
 
 typedef unsigned char    u8;
 typedef   signed int     b32;
 typedef   signed int     i32;
 typedef unsigned int     u32;
 typedef   signed long long i64;
+typedef unsigned long long u64;
 typedef ptrdiff_t        iz;
 typedef uintptr_t        uz;
 typedef          char    byte;
 
 #define assert(c)     while (!(c)) __builtin_trap()
 #define countof(a)    (iz)(sizeof(a) / sizeof(*(a)))
-#define new(a, t, n)  (t *)alloc(a, sizeof(t), n, _Alignof(t))
+#define new(a, t, n)  (t *)alloc(a, sizeof(t), n, _Alignof(t), 0)
+#define newnz(a, t, n) (t *)alloc(a, sizeof(t), n, _Alignof(t), NOZERO)
 #define s8(s)         {(u8 *)s, countof(s)-1}
 #define S(s)          (s8)s8(s)
 
@@ -26,15 +33,27 @@ typedef struct {
     iz  len;
 } s8;
 
+// File types as reported by directory listings
+enum {
+    FT_UNKNOWN,  // not reported, ask the OS when it matters
+    FT_FILE,
+    FT_DIR,
+    FT_LINK,
+    FT_OTHER,
+};
+
 typedef struct s8node s8node;
 struct s8node {
     s8node *next;
-    s8      str;
+    s8     *dir;   // listing's directory, ending in a separator, or null
+    s8      str;   // name within dir, or the whole path without one
+    i32     type;  // FT_* from the listing
 };
 
 typedef struct {
     byte *beg;
-    byte *end;
+    byte *end;    // end of committed memory
+    byte *limit;  // end of reserved address space
     os   *ctx;
 } arena;
 
@@ -46,25 +65,167 @@ typedef struct {
 
 static void os_write(os *, i32 fd, s8);
 static void os_exit(os *, i32 code);
+static b32  os_commit(os *, byte *, iz);
+static i32  os_ncpu(os *);
+
+// Run fn(arg, id) on n threads with ids [0, n) and wait for them all. Work
+// is claimed through counters in arg, so the platform may run fewer.
+static void os_parallel(os *, i32 n, void (*fn)(void *arg, i32 id), void *arg);
+
+enum { ARENA_GRAIN = 1 << 21 };  // commit granularity (one huge page)
+
+// Allocation flags. NOZERO skips clearing memory the caller is about to
+// overwrite anyway, such as I/O buffers and string copies.
+enum { NOZERO = 1 << 0 };
+
+// Commit enough of the reservation to hold need bytes past a->beg. Arenas
+// are copied by value for scratch use, so the range may already have been
+// committed through another copy; committing it again is harmless.
+static b32 grow_(arena *a, iz need)
+{
+    iz len = need - (a->end - a->beg);
+    len = (len + ARENA_GRAIN - 1) & -(iz)ARENA_GRAIN;
+    if (len > a->limit - a->end) {
+        len = a->limit - a->end;
+    }
+    if (!os_commit(a->ctx, a->end, len)) {
+        return 0;
+    }
+    a->end += len;
+    return 1;
+}
 
-static byte *alloc(arena *a, iz size, iz count, iz align)
+static byte *alloc(arena *a, iz size, iz count, iz align, i32 flags)
 {
     iz pad = -(uz)a->beg & (align - 1);
     iz avail = (a->end - a->beg) - pad;
     if (count > avail/size) {
-        // Integer overflow or out of memory
-        os_write(a->ctx, 2, S("vidir: out of memory\n"));
-        os_exit(a->ctx, 1);
+        iz reserve = (a->limit - a->beg) - pad;
+        if (count > reserve/size || !grow_(a, pad + size*count)) {
+            // Integer overflow or out of memory
+            os_write(a->ctx, 2, S("vidir: out of memory\n"));
+            os_exit(a->ctx, 1);
+        }
     }
     iz total = size * count;
     byte *p = a->beg + pad;
     a->beg += pad + total;
-    for (iz i = 0; i < total; i++) {
-        p[i] = 0;
+    if (!(flags & NOZERO)) {
+        for (iz i = 0; i < total; i++) {
+            p[i] = 0;
+        }
     }
     return p;
 }
 
+// Split a's remaining reservation for n threads to fill independently,
+// returning how many sub-arenas were made. The first continues a itself and
+// the rest are cut from the top of the reservation; only committed pages
+// cost memory, so generous slices are free. arena_join then resumes with
+// the first, giving back slices that were never touched.
+static i32 arena_split(arena *a, arena *subs, i32 n)
+{
+    iz min = (iz)ARENA_GRAIN << 5;
+    iz avail = a->limit - a->beg;
+    n = avail/min < n ? (i32)(avail/min) : n;
+    n = n < 1 ? 1 : n;
+    iz slice = avail/n & -(iz)ARENA_GRAIN;
+    subs[0] = *a;
+    for (i32 i = 1; i < n; i++) {
+        arena s = {0};
+        s.limit = a->limit - (i-1)*slice;
+        s.beg = s.end = s.limit - slice;
+        s.ctx = a->ctx;
+        subs[i] = s;
+    }
+    subs[0].limit = n > 1 ? subs[n-1].beg : a->limit;
+    subs[0].end = subs[0].end > subs[0].limit ? subs[0].limit : subs[0].end;
+    return n;
+}
+
+static void arena_join(arena *a, arena *subs, i32 n)
+{
+    byte *limit = n > 1 ? subs[1].limit : subs[0].limit;
+    for (i32 i = n-1; i > 0; i--) {
+        byte *start = i == n-1 ? subs[0].limit : subs[i+1].limit;
+        if (subs[i].beg != start) {
+            limit = start;  // lowest slice still holding data
+            break;
+        }
+    }
+    *a = subs[0];
+    a->limit = limit;
+}
+
+// How far arena_pack moves the contents of each sub-arena
+typedef struct {
+    byte *bottom;  // where the slices begin, above subs[0]
+    iz    slice;   // size of each slice
+    iz   *shift;   // by sub-arena, distance moved down
+    i32   n;
+} arenapack;
+
+// Plan packing the contents of subs[1, n) down onto the end of subs[0],
+// lowest slice first, with room for n shifts. Unlike arena_join, which
+// must keep the reservation below any slice holding data, packing gives
+// all of it back. Every pointer into the slices that lives on must first
+// be passed through arena_packed.
+static arenapack arena_pack_plan(arena *subs, i32 n, iz *shift)
+{
+    arenapack pk = {0};
+    pk.shift = shift;
+    pk.n = n;
+    shift[0] = 0;
+    if (n < 2) {
+        return pk;
+    }
+    pk.bottom = subs[0].limit;
+    pk.slice = (subs[1].limit - subs[0].limit) / (n-1);
+    byte *dst = subs[0].beg;
+    for (i32 i = n-1; i > 0; i--) {
+        byte *start = pk.bottom + (n-1-i)*pk.slice;
+        dst += -(uz)dst & 15;
+        shift[i] = start - dst;
+        dst += subs[i].beg - start;
+    }
+    return pk;
+}
+
+// Where p will point once packed
+static void *arena_packed(arenapack *pk, void *p)
+{
+    byte *b = p;
+    if (pk->n < 2 || b < pk->bottom) {
+        return p;  // null, or not in a slice
+    }
+    i32 i = pk->n - 1 - (i32)((b - pk->bottom) / pk->slice);
+    return b - pk->shift[i];
+}
+
+// Move the contents of the slices as planned and resume a after them,
+// with its whole reservation
+static void arena_pack(arena *a, arena *subs, i32 n, arenapack *pk)
+{
+    arena r = subs[0];
+    if (n > 1) {
+        r.limit = subs[1].limit;
+        byte *top = subs[1].beg - pk->shift[1];
+        if (top - r.beg > r.end - r.beg && !grow_(&r, top - r.beg)) {
+            os_write(r.ctx, 2, S("vidir: out of memory\n"));
+            os_exit(r.ctx, 1);
+        }
+        for (i32 i = n-1; i > 0; i--) {
+            byte *start = pk->bottom + (n-1-i)*pk->slice;
+            byte *dst = start - pk->shift[i];
+            for (iz j = 0; j < subs[i].beg - start; j++) {
+                dst[j] = start[j];
+            }
+        }
+        r.beg = top;
+    }
+    *a = r;
+}
+
 #define plan_push(a, s) \
   ((s)->len == (s)->cap \
     ? (s)->actions = push_((a), (s)->actions, &(s)->cap, \
@@ -76,14 +237,14 @@ static void *push_(arena *a, void *data, iz *pcap, iz size, iz align)
 {
     iz cap = *pcap;
     if (a->beg != (byte *)data + cap*size) {
-        void *copy = alloc(a, size, cap, align);
+        void *copy = alloc(a, size, cap, align, NOZERO);
         for (iz i = 0; i < cap*size; i++) {
             ((byte *)copy)[i] = ((byte *)data)[i];
         }
         data = copy;
     }
     iz extend = cap ? cap : 4;
-    alloc(a, size, extend, align);
+    alloc(a, size, extend, align, NOZERO);
     *pcap = cap + extend;
     return data;
 }
@@ -99,33 +260,65 @@ static s8 s8fromcstr(u8 *z)
 }
 
 // Append a string to a linked list of strings
-static s8node **s8list_append(arena *perm, s8node **tail, s8 str)
+static s8node **s8list_append(arena *perm, s8node **tail, s8 str, i32 type)
 {
     s8node *node = new(perm, s8node, 1);
     node->str = str;
-    node->next = 0;
+    node->type = type;
     *tail = node;
     return &node->next;
 }
 
+// Full path of a listed entry, built in perm when it has a directory
+static s8 s8node_path(s8node *n, arena *perm)
+{
+    if (!n->dir) {
+        return n->str;
+    }
+    s8 dir = *n->dir;
+    s8 r = {newnz(perm, u8, dir.len + n->str.len), dir.len + n->str.len};
+    for (iz i = 0; i < dir.len; i++) {
+        r.s[i] = dir.s[i];
+    }
+    for (iz i = 0; i < n->str.len; i++) {
+        r.s[dir.len+i] = n->str.s[i];
+    }
+    return r;
+}
+
 // Operation types for file rename plan
 typedef enum { 
     OP_DELETE,  // delete src (dst unused)
     OP_RENAME,  // clobbering move src to dst
-    OP_STASH,   // rename src to the temp name (dst unused)
-    OP_UNSTASH, // rename the temp name to dst (src unused)
+    OP_STASH,   // rename src to a temp name beside it (dst unused)
+    OP_UNSTASH, // rename its unit's temp name to dst (src unused)
 } Op;
 
+// Paths are named by their id in the plan's pathtab
+typedef u32 pathid;
+#define NO_PATH ((pathid)-1)
+typedef struct pathtab pathtab;
+
 typedef struct {
-    Op op;
-    s8 src;
-    s8 dst;
+    Op     op;
+    pathid src;
+    pathid dst;
+    i32    type;  // FT_* of the file being moved or deleted
 } Action;
 
+// Actions come in units: a delete, a rename, or a whole dependency chain
+// or cycle. Units depend on each other only through the paths they share
+// or that lie inside one another, which execute_plan checks for itself.
 typedef struct {
-    Action *actions;
-    iz      len;
-    iz      cap;
+    Action  *actions;
+    iz       len;
+    iz       cap;
+    pathtab *paths;          // names every path in the actions
+    iz      *units;          // index of each unit's first action
+    iz       nunits;
+    iz       units_cap;
+    iz       longest_chain;  // most renames in one dependency chain
+    iz       cycles;         // number of chains broken with a stash
 } Plan;
 
 enum { 
@@ -134,23 +327,111 @@ enum {
     NOT_FOUND = -1      // For pathmap.value: key not found in map
 };
 
-static u32 s8hash(s8 s)
+// Seed for s8hash, varied per run so that no fixed set of names collides
+static u64 hashseed = 0x2d358dccaa6c78a5;
+
+// Load 8 bytes, or fewer zero-extended, in any alignment
+static u64 load64_(u8 *p)
 {
-    u32 h = 0x811c9dc5;  // FNV-1a 32-bit offset basis
-    for (iz i = 0; i < s.len; i++) {
-        h ^= s.s[i];
-        h *= 0x01000193;  // FNV-1a 32-bit prime
+    u64 w;
+    __builtin_memcpy(&w, p, 8);
+    return w;
+}
+
+static u64 loadtail_(u8 *p, iz n)
+{
+    u64 w = 0;
+    for (iz i = 0; i < n; i++) {
+        w |= (u64)p[i] << (8*i);
+    }
+    return w;
+}
+
+// 64-bit hash of a string, 8 bytes per step, finished with a full
+// avalanche so every bit of the result depends on every input bit
+static u64 s8hash(s8 s)
+{
+    u64 h = hashseed ^ ((u64)s.len * 0x9e3779b97f4a7c15u);
+    iz i = 0;
+    for (; i+8 <= s.len; i += 8) {
+        h ^= load64_(s.s+i) * 0x9e3779b97f4a7c15u;
+        h = (h<<29 | h>>35) * 0xbf58476d1ce4e5b9u;
+    }
+    if (i < s.len) {
+        h ^= loadtail_(s.s+i, s.len-i) * 0x9e3779b97f4a7c15u;
+        h = (h<<29 | h>>35) * 0xbf58476d1ce4e5b9u;
     }
+    h ^= h >> 31;
+    h *= 0x94d049bb133111ebu;
+    h ^= h >> 29;
     return h;
 }
 
 static b32 s8equals(s8 a, s8 b)
 {
     if (a.len != b.len) return 0;
-    for (iz i = 0; i < a.len; i++) {
-        if (a.s[i] != b.s[i]) return 0;
+    if (a.s == b.s) return 1;
+    if (a.len < 8) {
+        return loadtail_(a.s, a.len) == loadtail_(b.s, b.len);
     }
-    return 1;
+    // Whole words, the last one overlapping the one before as needed
+    for (iz i = 0; i < a.len-8; i += 8) {
+        if (load64_(a.s+i) != load64_(b.s+i)) return 0;
+    }
+    return load64_(a.s+a.len-8) == load64_(b.s+b.len-8);
+}
+
+// Length of the longest common prefix of a and b, compared a word at a time
+static iz s8mismatch(s8 a, s8 b)
+{
+    iz len = a.len < b.len ? a.len : b.len;
+    iz i = 0;
+    for (; i+8 <= len; i += 8) {
+        u64 x = load64_(a.s+i) ^ load64_(b.s+i);
+        if (x) {
+            return i + __builtin_ctzll(x)/8;
+        }
+    }
+    for (; i < len && a.s[i] == b.s[i]; i++) {}
+    return i;
+}
+
+// Index of the first byte c in s, or s.len if there is none. Whole vectors
+// are compared at once where the target has them, and words elsewhere.
+static iz s8index(s8 s, u8 c)
+{
+    iz i = 0;
+    #if __AVX2__
+    __m256i want32 = _mm256_set1_epi8((char)c);
+    for (; i+32 <= s.len; i += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i *)(s.s + i));
+        u32 hits = (u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, want32));
+        if (hits) {
+            return i + __builtin_ctz(hits);
+        }
+    }
+    #endif
+    #if __SSE2__
+    __m128i want = _mm_set1_epi8((char)c);
+    for (; i+16 <= s.len; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i *)(s.s + i));
+        u32 hits = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(v, want));
+        if (hits) {
+            return i + __builtin_ctz(hits);
+        }
+    }
+    #else
+    // A zero byte in x flags a match; the bytes loop below pins it down
+    u64 ones = 0x0101010101010101u;
+    for (; i+8 <= s.len; i += 8) {
+        u64 x = load64_(s.s+i) ^ (ones * c);
+        if ((x - ones) & ~x & (ones << 7)) break;
+    }
+    #endif
+    for (; i < s.len; i++) {
+        if (s.s[i] == c) return i;
+    }
+    return s.len;
 }
 
 // Bit array helpers (u32 elements) - for boolean tracking with reduced memory
@@ -169,66 +450,148 @@ static b32 bitarray_get(u32 *bits, iz index)
     return (bits[index / 32] >> (index % 32)) & 1;
 }
 
-typedef struct pathmap pathmap;
-struct pathmap {
-    pathmap *child[4];   // 4-way trie
-    s8       key;        // the path string
-    iz       value;      // 0-based array index (-1 = not found)
-};
+// Set bits [beg, end), returning false if any of them was already set.
+// Threads may claim bits of one array at once.
+static b32 bitarray_claim(u32 *bits, iz beg, iz end)
+{
+    u32 was = 0;
+    while (beg < end) {
+        iz i = beg / 32;
+        iz hi = end - i*32 < 32 ? end - i*32 : 32;
+        u32 mask = (hi < 32 ? ((u32)1 << hi) - 1 : (u32)-1) & ((u32)-1 << (beg % 32));
+        was |= __atomic_fetch_or(bits + i, mask, __ATOMIC_RELAXED) & mask;
+        beg = i*32 + hi;
+    }
+    return !was;
+}
+
+// Flat open-addressing hash table keyed by path, behind pathmap. Slots sit
+// in groups of MAP_GROUP behind one control byte each, holding 7 bits of
+// the key's hash or CTRL_EMPTY, so a probe checks a whole group at once
+// and compares keys only on a tag match. Nothing is ever removed. Pointers
+// into the table stay valid until the next insert.
+enum { MAP_GROUP = 16, CTRL_EMPTY = 0x80 };
 
-// Combined value type for duplicate target tracking
 typedef struct {
-    iz last_idx;   // Last index wanting this target
-    iz dup_count;  // Count of duplicates seen
-} dup_target;
-
-typedef struct dup_target_map dup_target_map;
-struct dup_target_map {
-    dup_target_map *child[4];  // 4-way trie
-    s8              key;
-    dup_target      value;
-};
+    u8   *ctrl;   // cap control bytes, following the slots
+    byte *slots;  // cap slots of stride bytes, each starting with its key
+    iz    cap;    // a power of two, at least MAP_GROUP
+    iz    len;
+} flatmap;
+
+// Bitmask of the slots in the group at ctrl whose control byte is tag
+static u32 flatmap_match_(u8 *ctrl, u8 tag)
+{
+    #if __SSE2__
+    __m128i group = _mm_loadu_si128((__m128i *)ctrl);
+    __m128i want = _mm_set1_epi8((char)tag);
+    return (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(group, want));
+    #else
+    u32 mask = 0;
+    for (i32 i = 0; i < MAP_GROUP; i++) {
+        mask |= (u32)(ctrl[i] == tag) << i;
+    }
+    return mask;
+    #endif
+}
 
-// Insert or lookup in dup_target_map
-static dup_target *dup_target_map_insert(dup_target_map **m, s8 key, arena *perm)
+// Find the slot holding key. If missing, claim an empty slot for it when
+// claim is set (the table must have room), or else return null. A new
+// slot's value bytes are all ones, so every iz in it reads NOT_FOUND.
+static byte *flatmap_probe_(flatmap *m, s8 key, u64 hash, iz stride, b32 claim)
 {
-    for (u32 h = s8hash(key); *m; h <<= 2) {
-        if (s8equals((*m)->key, key)) {
-            return &(*m)->value;
+    u8 tag = (u8)(hash >> 57);
+    iz mask = m->cap/MAP_GROUP - 1;
+    for (iz g = (iz)(hash >> 32) & mask, step = 1;; g = (g + step++) & mask) {
+        u8 *ctrl = m->ctrl + g*MAP_GROUP;
+        for (u32 hits = flatmap_match_(ctrl, tag); hits; hits &= hits - 1) {
+            byte *slot = m->slots + (g*MAP_GROUP + __builtin_ctz(hits))*stride;
+            if (s8equals(*(s8 *)slot, key)) {
+                return slot;
+            }
+        }
+        u32 empty = flatmap_match_(ctrl, CTRL_EMPTY);
+        if (empty) {
+            if (!claim) {
+                return 0;
+            }
+            iz i = g*MAP_GROUP + __builtin_ctz(empty);
+            byte *slot = m->slots + i*stride;
+            m->ctrl[i] = tag;
+            m->len++;
+            *(s8 *)slot = key;
+            for (iz j = sizeof(s8); j < stride; j++) {
+                slot[j] = (byte)0xff;
+            }
+            return slot;
         }
-        m = &(*m)->child[h>>30];
     }
-    if (!perm) {
-        return 0;
+}
+
+// Double the table, or create it. Slots and control bytes share a block,
+// and when the old block lies just beneath the new one, as when nothing
+// else was allocated since it grew, the new block slides down over it.
+static void flatmap_grow_(flatmap *m, iz stride, arena *perm)
+{
+    flatmap old = *m;
+    m->cap = old.cap ? old.cap*2 : MAP_GROUP;
+    m->len = 0;
+    iz size = (stride + 1) * m->cap;
+    m->slots = alloc(perm, 1, size, _Alignof(iz), NOZERO);
+    m->ctrl = (u8 *)m->slots + stride*m->cap;
+    for (iz i = 0; i < m->cap; i++) {
+        m->ctrl[i] = CTRL_EMPTY;
+    }
+    for (iz i = 0; i < old.cap; i++) {
+        if (old.ctrl[i] != CTRL_EMPTY) {
+            byte *src = old.slots + i*stride;
+            s8 key = *(s8 *)src;
+            byte *dst = flatmap_probe_(m, key, s8hash(key), stride, 1);
+            for (iz j = 0; j < stride; j++) {
+                dst[j] = src[j];
+            }
+        }
+    }
+
+    if (old.cap && (byte *)old.ctrl + old.cap == m->slots) {
+        for (iz i = 0; i < size; i++) {
+            old.slots[i] = m->slots[i];
+        }
+        m->slots = old.slots;
+        m->ctrl = (u8 *)m->slots + stride*m->cap;
+        perm->beg = m->slots + size;
     }
-    *m = new(perm, dup_target_map, 1);
-    (*m)->key = key;
-    (*m)->value.last_idx = NOT_FOUND;
-    (*m)->value.dup_count = NOT_FOUND;
-    return &(*m)->value;
 }
 
-static dup_target *dup_target_map_lookup(dup_target_map **m, s8 key)
+// Insert or lookup key, returning its slot. Without perm, returns null
+// when the key is missing.
+static byte *flatmap_insert_(flatmap **pm, s8 key, iz stride, arena *perm)
 {
-    return dup_target_map_insert(m, key, 0);
+    flatmap *m = *pm;
+    if (!perm) {
+        return m ? flatmap_probe_(m, key, s8hash(key), stride, 0) : 0;
+    }
+    if (!m) {
+        m = *pm = new(perm, flatmap, 1);
+    }
+    if ((m->len+1)*8 > m->cap*7) {
+        flatmap_grow_(m, stride, perm);  // keep at most 7/8 full
+    }
+    return flatmap_probe_(m, key, s8hash(key), stride, 1);
 }
 
+typedef flatmap pathmap;
+
+typedef struct {
+    s8 key;
+    iz value;  // 0-based array index (-1 = not found)
+} pathslot;
+
 // Insert or lookup a path in the map (path -> array index)
 static iz *pathmap_insert(pathmap **m, s8 key, arena *perm)
 {
-    for (u32 h = s8hash(key); *m; h <<= 2) {
-        if (s8equals((*m)->key, key)) {
-            return &(*m)->value;
-        }
-        m = &(*m)->child[h>>30];  // Use top 2 bits
-    }
-    if (!perm) {
-        return 0;  // Not found, don't create
-    }
-    *m = new(perm, pathmap, 1);
-    (*m)->key = key;
-    (*m)->value = NOT_FOUND;
-    return &(*m)->value;
+    pathslot *slot = (pathslot *)flatmap_insert_(m, key, sizeof(pathslot), perm);
+    return slot ? &slot->value : 0;
 }
 
 // Lookup a path in the reverse map
@@ -237,27 +600,13 @@ static iz *pathmap_lookup(pathmap **m, s8 key)
     return pathmap_insert(m, key, 0);
 }
 
-// Extract directory path from a file path
-static s8 dirname_s8(s8 path)
+static s8 cuthead(s8 s, iz off)
 {
-    iz last_slash = -1;
-    for (iz i = path.len - 1; i >= 0; i--) {
-        if (path.s[i] == '/' || path.s[i] == '\\') {
-            last_slash = i;
-            break;
-        }
-    }
-    
-    if (last_slash == -1) {
-        return S(".");  // No slash found, use current directory
-    }
-    
-    if (last_slash == 0) {
-        return S("/");  // Root directory
-    }
-    
-    // Return slice of original string up to last slash
-    return (s8){path.s, last_slash};
+    assert(off >= 0);
+    assert(off <= s.len);
+    s.s += off;
+    s.len -= off;
+    return s;
 }
 
 static s8 takehead(s8 s, iz len)
@@ -268,194 +617,791 @@ static s8 takehead(s8 s, iz len)
     return s;
 }
 
-static b32 startswith(s8 s, s8 prefix)
+// Interned paths: each distinct path is stored once and named by a dense
+// id, so per-path state lives in plain arrays indexed by id. An entry is
+// its directory's id plus the last component, split at either separator,
+// so the prefix a listing's paths share is stored once, and full strings
+// are only built for the temp file and the OS. Equal paths have equal ids,
+// and a directory's id is smaller than any id inside it. The index holds
+// ids behind control bytes, probed like flatmap.
+typedef struct {
+    u8    *name;    // last component, free of separators
+    u32    len;
+    pathid parent;  // NO_PATH for the first component
+    u32    hash;    // of the whole path
+    u8     sep;     // separator before name, 0 for the first component
+} pathent;
+
+struct pathtab {
+    pathent *ents;     // by id, room for 7/8 of cap
+    iz       len;
+    pathid  *slots;    // cap ids, following their control bytes
+    u8      *ctrl;
+    iz       cap;      // a power of two, at least MAP_GROUP
+    pathid   lastdir;  // directory of the last path interned
+};
+
+static pathtab *new_pathtab(arena *perm)
 {
-    return s.len >= prefix.len && s8equals(takehead(s, prefix.len), prefix);
+    pathtab *t = new(perm, pathtab, 1);
+    t->lastdir = NO_PATH;
+    return t;
 }
 
-// String comparison for sorting
-static iz u8compare(u8 *a, u8 *b, iz n)
+static u32 pathtab_hash_(pathtab *t, pathid parent, u8 sep, s8 name)
 {
-    for (; n; n--) {
-        iz d = *a++ - *b++;
-        if (d) return d;
+    u64 h = s8hash(name);
+    if (parent != NO_PATH) {
+        h ^= ((u64)t->ents[parent].hash << 8 | sep) * 0x9e3779b97f4a7c15u;
+        h ^= h >> 32;
+        h *= 0xbf58476d1ce4e5b9u;
     }
-    return 0;
+    return (u32)(h >> 32);
 }
 
-static iz s8compare_(s8 a, s8 b)
+// Find name under parent, or with perm, add it under the next id, first
+// copying the name into perm when copy is set
+static pathid pathtab_probe_(pathtab *t, pathid parent, u8 sep, s8 name, u32 hash, arena *perm, b32 copy)
 {
-    iz len = a.len<b.len ? a.len : b.len;
-    iz r   = u8compare(a.s, b.s, len);
-    return r ? r : a.len-b.len;
+    u8 tag = (u8)(hash >> 25);
+    iz mask = t->cap/MAP_GROUP - 1;
+    for (iz g = (iz)hash & mask, step = 1;; g = (g + step++) & mask) {
+        u8 *ctrl = t->ctrl + g*MAP_GROUP;
+        for (u32 hits = flatmap_match_(ctrl, tag); hits; hits &= hits - 1) {
+            pathid id = t->slots[g*MAP_GROUP + __builtin_ctz(hits)];
+            pathent *e = t->ents + id;
+            if (e->hash == hash && e->parent == parent && e->sep == sep &&
+                s8equals((s8){e->name, e->len}, name)) {
+                return id;
+            }
+        }
+        u32 empty = flatmap_match_(ctrl, CTRL_EMPTY);
+        if (empty) {
+            if (!perm) {
+                return NO_PATH;
+            }
+            if (copy) {
+                u8 *s = newnz(perm, u8, name.len);
+                for (iz i = 0; i < name.len; i++) {
+                    s[i] = name.s[i];
+                }
+                name.s = s;
+            }
+            iz i = g*MAP_GROUP + __builtin_ctz(empty);
+            t->ctrl[i] = tag;
+            t->slots[i] = (pathid)t->len;
+            t->ents[t->len] = (pathent){name.s, (u32)name.len, parent, hash, sep};
+            return (pathid)t->len++;
+        }
+    }
 }
 
-// Merge sort for s8node linked list
-static s8node *s8sort_(s8node *head)
+// Grow the index to hold at least n ids, and the entries to match
+static void pathtab_reserve(pathtab *t, iz n, arena *perm)
 {
-    if (!head || !head->next) {
-        return head;
+    if (n*8 <= t->cap*7) {
+        return;
     }
+    iz cap = t->cap ? t->cap : MAP_GROUP;
+    for (; n*8 > cap*7; cap *= 2) {}
+    t->cap = cap;
 
-    iz      len  = 0;
-    s8node *tail = head;
-    s8node *last = head;
-    for (s8node *n = head; n; n = n->next, len++) {
-        if (len & 1) {
-            last = tail;
-            tail = tail->next;
-        }
+    pathent *ents = newnz(perm, pathent, cap/8*7);
+    for (iz id = 0; id < t->len; id++) {
+        ents[id] = t->ents[id];
+    }
+    t->ents = ents;
+    t->ctrl = newnz(perm, u8, t->cap);
+    t->slots = newnz(perm, pathid, t->cap);
+    for (iz i = 0; i < t->cap; i++) {
+        t->ctrl[i] = CTRL_EMPTY;
     }
 
-    last->next = 0;
-    head = s8sort_(head);
-    tail = s8sort_(tail);
-
-    s8node  *rhead = 0;
-    s8node **rtail = &rhead;
-    while (head && tail) {
-        if (s8compare_(head->str, tail->str) < 1) {
-            *rtail = head;
-            head = head->next;
-        } else {
-            *rtail = tail;
-            tail = tail->next;
+    // Cached hashes place every id without touching its name
+    iz mask = t->cap/MAP_GROUP - 1;
+    for (iz id = 0; id < t->len; id++) {
+        u32 hash = t->ents[id].hash;
+        for (iz g = (iz)hash & mask, step = 1;; g = (g + step++) & mask) {
+            u32 empty = flatmap_match_(t->ctrl + g*MAP_GROUP, CTRL_EMPTY);
+            if (empty) {
+                iz i = g*MAP_GROUP + __builtin_ctz(empty);
+                t->ctrl[i] = (u8)(hash >> 25);
+                t->slots[i] = (pathid)id;
+                break;
+            }
         }
-        rtail = &(*rtail)->next;
     }
-    *rtail = head ? head : tail;
-    return rhead;
 }
 
-static b32  os_path_exists(os *ctx, arena scratch, s8 path);
-
-// File system state tracker to cache OS queries
-typedef struct {
-    pathmap *existing_files;  // Maps path -> 1 if file exists
-    os      *ctx;
-} fsstate;
+// Id of name under parent (NO_PATH for a first component), added if new
+// when given perm. Unless copied, the name must outlive the table.
+static pathid pathtab_child(pathtab *t, pathid parent, u8 sep, s8 name, arena *perm, b32 copy)
+{
+    if (!perm) {
+        return t->len ? pathtab_probe_(t, parent, sep, name, pathtab_hash_(t, parent, sep, name), 0, 0) : NO_PATH;
+    }
+    if ((t->len+1)*8 > t->cap*7) {
+        pathtab_reserve(t, t->len + 1, perm);  // keep at most 7/8 full
+    }
+    return pathtab_probe_(t, parent, sep, name, pathtab_hash_(t, parent, sep, name), perm, copy);
+}
 
-static fsstate *new_fsstate(os *ctx, arena *perm)
+// Whether id names path, taken as following base and sep
+static b32 pathtab_match_(pathtab *t, pathid id, pathid base, u8 sep, s8 path)
 {
-    fsstate *fs = new(perm, fsstate, 1);
-    fs->existing_files = 0;
-    fs->ctx = ctx;
-    return fs;
+    for (; id != NO_PATH; id = t->ents[id].parent) {
+        pathent *e = t->ents + id;
+        iz beg = path.len - e->len;
+        if (beg < 0 || !s8equals((s8){e->name, e->len}, (s8){path.s + beg, e->len})) {
+            return 0;
+        }
+        if (beg == 0) {
+            return e->parent == base && e->sep == sep;
+        }
+        if (path.s[beg-1] != e->sep) {
+            return 0;
+        }
+        path.len = beg - 1;
+    }
+    return 0;
 }
 
-static void fsstate_mark_exists(fsstate *fs, s8 path, arena *perm)
+// Id of path, taken as following base and sep, added along with its
+// directories when given perm, copying new components there if asked.
+// Paths in listing order mostly share the directory of the one before,
+// which is then matched without hashing it again.
+static pathid pathtab_path_(pathtab *t, pathid base, u8 sep, s8 path, arena *perm, b32 copy)
 {
-    iz *exists = pathmap_insert(&fs->existing_files, path, perm);
-    *exists = 1;
+    iz j = path.len;
+    for (; j > 0 && path.s[j-1] != '/' && path.s[j-1] != '\\'; j--) {}
+    pathid parent = base;
+    if (j > 0) {
+        s8 dir = takehead(path, j-1);
+        if (t->lastdir != NO_PATH && pathtab_match_(t, t->lastdir, base, sep, dir)) {
+            parent = t->lastdir;
+        } else {
+            parent = pathtab_path_(t, base, sep, dir, perm, copy);
+            if (parent == NO_PATH) {
+                return NO_PATH;
+            }
+        }
+        if (perm) {
+            t->lastdir = parent;
+        }
+        sep = path.s[j-1];
+    }
+    s8 name = {path.s + j, path.len - j};
+    return pathtab_child(t, parent, sep, name, perm, copy);
 }
 
-static void fsstate_mark_deleted(fsstate *fs, s8 path, arena *perm)
+// Id of path, added if new. Unless copied, path must outlive the table.
+static pathid pathtab_intern(pathtab *t, s8 path, arena *perm, b32 copy)
 {
-    iz *exists = pathmap_insert(&fs->existing_files, path, perm);
-    *exists = 0;
+    return pathtab_path_(t, NO_PATH, 0, path, perm, copy);
 }
 
-static b32 fsstate_exists(fsstate *fs, s8 path, arena *perm)
+// Id of path, or NO_PATH if it was never interned
+static pathid pathtab_find(pathtab *t, s8 path)
 {
-    iz *exists = pathmap_lookup(&fs->existing_files, path);
-    if (exists) {
-        return *exists != 0;
-    }
-    
-    // First time seeing this path - query OS once and cache result
-    arena scratch = *perm;
-    b32 file_exists = os_path_exists(fs->ctx, scratch, path);
-    
-    // Cache the result
-    iz *cached = pathmap_insert(&fs->existing_files, path, perm);
-    *cached = file_exists ? 1 : 0;
-    
-    return file_exists;
+    return pathtab_path_(t, NO_PATH, 0, path, 0, 0);
 }
 
-// Generate a unique non-conflicting name for a file
-static s8 fsstate_unique_name(fsstate *fs, s8 base_path, arena *perm)
+// Id of the path id names beneath from, taken beneath to instead, added
+// if new when given perm, else NO_PATH unless already interned
+static pathid pathtab_rebase(pathtab *t, pathid id, pathid from, pathid to, arena *perm)
 {
-    if (!fsstate_exists(fs, base_path, perm)) {
-        return base_path;  // No conflict
+    if (id == from) {
+        return to;
     }
-    
-    // Try base_path~, base_path~1, base_path~2, etc.
-    iz max_len = base_path.len + 20;  // Room for ~999999...
-    u8 *candidate = new(perm, u8, max_len);
-    
-    // Copy base path
-    for (iz i = 0; i < base_path.len; i++) {
-        candidate[i] = base_path.s[i];
+    pathent e = t->ents[id];
+    pathid parent = pathtab_rebase(t, e.parent, from, to, perm);
+    if (parent == NO_PATH) {
+        return NO_PATH;
     }
-    candidate[base_path.len] = '~';
-    
-    s8 candidate_path = {candidate, base_path.len + 1};
-    if (!fsstate_exists(fs, candidate_path, perm)) {
-        return candidate_path;
+    return pathtab_child(t, parent, e.sep, (s8){e.name, e.len}, perm, 0);
+}
+
+// Length of the full path of id
+static iz pathtab_len(pathtab *t, pathid id)
+{
+    iz len = 0;
+    for (pathid p = id; p != NO_PATH; p = t->ents[p].parent) {
+        len += t->ents[p].len + (t->ents[p].sep != 0);
     }
-    
-    // Try with numbers
-    for (i32 counter = 1; ; counter++) {
-        iz pos = base_path.len + 1;
-        i32 temp_counter = counter;
-        
-        // Convert counter to digits
-        u8 digits[16];
-        iz digit_count = 0;
-        do {
-            digits[digit_count++] = '0' + (temp_counter % 10);
-            temp_counter /= 10;
-        } while (temp_counter > 0);
-        
-        // Copy digits in correct order
-        for (iz i = 0; i < digit_count; i++) {
-            candidate[pos + i] = digits[digit_count - 1 - i];
-        }
-        
-        candidate_path.len = pos + digit_count;
-        if (!fsstate_exists(fs, candidate_path, perm)) {
-            return candidate_path;
+    return len;
+}
+
+// Write the full path of id, len bytes long, to dst
+static void pathtab_put_(pathtab *t, pathid id, u8 *dst, iz len)
+{
+    for (pathid p = id; p != NO_PATH; p = t->ents[p].parent) {
+        pathent *e = t->ents + p;
+        len -= e->len;
+        for (iz i = 0; i < e->len; i++) {
+            dst[len+i] = e->name[i];
         }
-        
-        // Prevent overflow
-        if (counter == 0x7fffffff) {  // INT32_MAX
-            return base_path;  // Just give up...
+        if (e->sep) {
+            dst[--len] = e->sep;
         }
     }
 }
 
-static void os_write(os *, i32 fd, s8);
-static i32  os_read(os *, i32 fd, u8 *, i32);
-static b32  os_path_is_dir(os *ctx, arena scratch, s8 path);
-static b32  os_path_exists(os *ctx, arena scratch, s8 path);
-static s8node *os_list_dir(os *ctx, arena *perm, s8 path);
-static b32  os_invoke_editor(os *ctx, arena scratch);
-static void os_close_temp_file(os *ctx);
-static void os_open_temp_file(os *ctx);
-static void os_remove_temp_file(os *ctx);
-static b32  os_rename_file(os *ctx, arena scratch, s8 src, s8 dst);
-static b32  os_delete_path(os *ctx, arena scratch, s8 path);
-static b32  os_create_dir(os *ctx, arena scratch, s8 path);
-static void os_exit(os *ctx, i32 code);
-
-typedef struct {
-    arena *perm;
-    os    *ctx;
-    u8    *buf;
-    iz     len;
-    iz     cap;
-    i32    fd;
-} u8buf;
-
-static u8buf *newfdbuf(arena *perm, i32 fd, iz cap)
+// Full path of id, built in perm
+static s8 pathtab_get(pathtab *t, pathid id, arena *perm)
 {
-    u8buf *b = new(perm, u8buf, 1);
-    b->cap = cap;
-    b->buf = new(perm, u8, cap);
-    b->fd  = fd;
-    b->ctx = perm->ctx;
-    return b;
+    if (id == NO_PATH) {
+        return (s8){0};
+    }
+    iz len = pathtab_len(t, id);
+    s8 r = {newnz(perm, u8, len), len};
+    pathtab_put_(t, id, r.s, len);
+    return r;
+}
+
+// Directory holding id, as a path for the OS, built in perm
+static s8 pathtab_dirname(pathtab *t, pathid id, arena *perm)
+{
+    pathid dir = t->ents[id].parent;
+    if (dir == NO_PATH) {
+        return S(".");  // No separator, use current directory
+    }
+    s8 r = pathtab_get(t, dir, perm);
+    return r.len ? r : S("/");  // Root directory
+}
+
+static b32 startswith(s8 s, s8 prefix)
+{
+    return s.len >= prefix.len && s8equals(takehead(s, prefix.len), prefix);
+}
+
+// Parse a non-negative decimal integer, rejecting junk and overflow
+static b32 s8toi32(s8 s, i32 *r)
+{
+    i32 n = 0;
+    for (iz i = 0; i < s.len; i++) {
+        if (s.s[i] < '0' || s.s[i] > '9') return 0;
+        i32 digit = s.s[i] - '0';
+        if (n > (0x7fffffff - digit) / 10) return 0;
+        n = n*10 + digit;
+    }
+    *r = n;
+    return s.len > 0;
+}
+
+// String comparison for sorting
+static iz u8compare(u8 *a, u8 *b, iz n)
+{
+    for (; n; n--) {
+        iz d = *a++ - *b++;
+        if (d) return d;
+    }
+    return 0;
+}
+
+static iz s8compare_(s8 a, s8 b)
+{
+    iz len = a.len<b.len ? a.len : b.len;
+    iz r   = u8compare(a.s, b.s, len);
+    return r ? r : a.len-b.len;
+}
+
+// Sorting works on an array of records holding the next eight bytes of
+// each string as a big-endian integer, so most comparisons are a single
+// integer compare on contiguous memory rather than a walk over the list.
+typedef struct {
+    u64     key;
+    s8node *node;
+    s8      str;   // the bytes sorted on
+} sortrec;
+
+enum {
+    SORT_SMALL    = 32,       // insertion sort at or below this many records
+    SORT_PARALLEL = 1 << 16,  // split across threads at or above this many
+    SORT_BUCKETS  = 257*257,  // two-byte partition, 0 meaning end of string
+    SORT_LEVELS   = 8,        // radix levels before falling back to merging
+};
+
+// Next eight bytes of s starting at depth, zero padded past the end. Paths
+// never contain a null byte, so padding cannot tie with real contents.
+static u64 sortkey_(s8 s, iz depth)
+{
+    u64 key = 0;
+    iz  len = s.len - depth;
+    len = len < 0 ? 0 : len > 8 ? 8 : len;
+    for (iz i = 0; i < len; i++) {
+        key |= (u64)s.s[depth+i] << (56 - 8*i);
+    }
+    return key;
+}
+
+// Stable insertion sort on the bytes past depth
+static void insertion_sort_(sortrec *r, iz n, iz depth)
+{
+    for (iz i = 1; i < n; i++) {
+        sortrec x = r[i];
+        s8 xs = x.str;
+        iz j = i;
+        for (; j > 0; j--) {
+            s8 ys = r[j-1].str;
+            s8 a = {ys.s + depth, ys.len - depth};
+            s8 b = {xs.s + depth, xs.len - depth};
+            if (s8compare_(a, b) <= 0) break;
+            r[j] = r[j-1];
+        }
+        r[j] = x;
+    }
+}
+
+// Stable merge sort on the bytes past depth, for runs that share so long a
+// prefix that further radix levels would only grow the stack.
+static void merge_sort_(sortrec *r, sortrec *tmp, iz n, iz depth)
+{
+    if (n <= SORT_SMALL) {
+        insertion_sort_(r, n, depth);
+        return;
+    }
+    iz half = n / 2;
+    merge_sort_(r, tmp, half, depth);
+    merge_sort_(r + half, tmp + half, n - half, depth);
+    iz i = 0, j = half, k = 0;
+    while (i < half && j < n) {
+        s8 a = r[i].str;
+        s8 b = r[j].str;
+        a = (s8){a.s + depth, a.len - depth};
+        b = (s8){b.s + depth, b.len - depth};
+        tmp[k++] = s8compare_(b, a) < 0 ? r[j++] : r[i++];
+    }
+    while (i < half) tmp[k++] = r[i++];
+    while (j < n)    tmp[k++] = r[j++];
+    for (k = 0; k < n; k++) {
+        r[k] = tmp[k];
+    }
+}
+
+// Sort records that share their first depth bytes. The result ends up in
+// r; tmp is scratch space of the same size. Each level is a stable LSD
+// radix sort on the 64-bit key, skipping byte positions that do not vary,
+// followed by recursion into runs whose keys tie.
+static void radix_sort_(sortrec *r, sortrec *tmp, iz n, iz depth, i32 level)
+{
+    if (n <= SORT_SMALL) {
+        insertion_sort_(r, n, depth);
+        return;
+    }
+
+    u32 counts[8][256] = {0};
+    for (iz i = 0; i < n; i++) {
+        u64 key = sortkey_(r[i].str, depth);
+        r[i].key = key;
+        for (i32 b = 0; b < 8; b++) {
+            counts[b][key >> (8*b) & 0xff]++;
+        }
+    }
+
+    sortrec *src = r;
+    sortrec *dst = tmp;
+    for (i32 b = 0; b < 8; b++) {
+        u32 *c = counts[b];
+        if (c[src[0].key >> (8*b) & 0xff] == (u32)n) {
+            continue;  // every key has the same byte here
+        }
+        iz offsets[256];
+        iz total = 0;
+        for (i32 d = 0; d < 256; d++) {
+            offsets[d] = total;
+            total += c[d];
+        }
+        for (iz i = 0; i < n; i++) {
+            dst[offsets[src[i].key >> (8*b) & 0xff]++] = src[i];
+        }
+        sortrec *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != r) {
+        for (iz i = 0; i < n; i++) {
+            r[i] = src[i];
+        }
+    }
+
+    for (iz beg = 0; beg < n;) {
+        iz end = beg + 1;
+        b32 longer = r[beg].str.len > depth + 8;
+        for (; end < n && r[end].key == r[beg].key; end++) {
+            longer |= r[end].str.len > depth + 8;
+        }
+        if (end - beg > 1) {
+            if (longer && level+1 < SORT_LEVELS) {
+                radix_sort_(r + beg, tmp + beg, end - beg, depth + 8, level + 1);
+            } else if (longer) {
+                merge_sort_(r + beg, tmp + beg, end - beg, depth);
+            } else {
+                insertion_sort_(r + beg, end - beg, depth);
+            }
+        }
+        beg = end;
+    }
+}
+
+static i32 sortdigit_(s8 s, iz depth)
+{
+    return depth < s.len ? s.s[depth] + 1 : 0;
+}
+
+typedef struct {
+    sortrec *recs;
+    sortrec *tmp;
+    iz      *bounds;  // SORT_BUCKETS+1 offsets into recs
+    iz       depth;
+    i32      next;    // next bucket to claim
+} sortjob;
+
+static void sort_worker_(void *arg, i32 id)
+{
+    (void)id;
+    sortjob *job = arg;
+    for (;;) {
+        i32 b = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (b >= SORT_BUCKETS) return;
+        iz beg = job->bounds[b];
+        iz len = job->bounds[b+1] - beg;
+        if (len > 1 && b/257 && b%257) {  // else all paths are identical
+            radix_sort_(job->recs + beg, job->tmp + beg, len, job->depth + 2, 0);
+        }
+    }
+}
+
+// Sort records that share their first depth bytes across nthreads threads:
+// partition on the next two bytes, then sort each bucket independently.
+static void parallel_sort_(arena scratch, sortrec *r, iz n, iz depth, i32 nthreads)
+{
+    sortrec *tmp = newnz(&scratch, sortrec, n);
+    if (nthreads < 2 || n < SORT_PARALLEL) {
+        radix_sort_(r, tmp, n, depth, 0);
+        return;
+    }
+
+    iz *bounds = new(&scratch, iz, SORT_BUCKETS+1);
+    for (iz i = 0; i < n; i++) {
+        s8 s = r[i].str;
+        i32 b = sortdigit_(s, depth)*257 + sortdigit_(s, depth+1);
+        r[i].key = (u64)b;
+        bounds[b+1]++;
+    }
+    for (i32 b = 0; b < SORT_BUCKETS; b++) {
+        bounds[b+1] += bounds[b];
+    }
+    iz *fill = newnz(&scratch, iz, SORT_BUCKETS);
+    for (i32 b = 0; b < SORT_BUCKETS; b++) {
+        fill[b] = bounds[b];
+    }
+    for (iz i = 0; i < n; i++) {
+        tmp[fill[r[i].key]++] = r[i];
+    }
+
+    sortjob job = {0};
+    job.recs = tmp;
+    job.tmp = r;
+    job.bounds = bounds;
+    job.depth = depth;
+    os_parallel(scratch.ctx, nthreads, sort_worker_, &job);
+
+    for (iz i = 0; i < n; i++) {
+        r[i] = tmp[i];
+    }
+}
+
+// Sort a list of paths by bytes, the same order as s8compare_, stably. The
+// bytes every path shares (typically the directory) are skipped up front.
+// Entries of a single listing are sorted on their names alone; others have
+// their full paths built in scratch.
+static s8node *s8sort_(s8node *head, arena scratch)
+{
+    iz n = 0;
+    b32 shared = 1;
+    for (s8node *p = head; p; p = p->next) {
+        shared &= p->dir == head->dir;
+        n++;
+    }
+    if (n < 2) {
+        return head;
+    }
+
+    sortrec *recs = newnz(&scratch, sortrec, n);
+    n = 0;
+    for (s8node *p = head; p; p = p->next) {
+        s8 s = shared ? p->str : s8node_path(p, &scratch);
+        recs[n++] = (sortrec){0, p, s};
+    }
+    s8 first = recs[0].str;
+    iz depth = first.len;
+    for (iz k = 1; k < n; k++) {
+        s8 s = recs[k].str;
+        iz i = 0;
+        iz max = s.len < depth ? s.len : depth;
+        for (; i < max && s.s[i] == first.s[i]; i++) {}
+        depth = i;
+    }
+
+    parallel_sort_(scratch, recs, n, depth, os_ncpu(scratch.ctx));
+
+    for (iz i = 0; i < n-1; i++) {
+        recs[i].node->next = recs[i+1].node;
+    }
+    recs[n-1].node->next = 0;
+    return recs[0].node;
+}
+
+static b32  os_path_exists(os *ctx, arena scratch, s8 path);
+static b32  os_create_dir(os *ctx, arena scratch, s8 path);
+
+// Calls made through the os_* layer, counted by the platform
+typedef struct {
+    i64 stat;
+    i64 rename;
+    i64 unlink;
+    i64 rmdir;
+    i64 mkdir;
+    i64 readdir;
+} oscounters;
+
+// Counters may be bumped from several threads at once
+#define oscount(n) __atomic_add_fetch(&(n), 1, __ATOMIC_RELAXED)
+
+// Phases of a session, timed separately for --stats
+enum {
+    PHASE_LIST,     // argument expansion and os_list_dir
+    PHASE_SORT,     // s8sort_
+    PHASE_WRITE,    // temp file serialization
+    PHASE_EDITOR,   // waiting on the editor
+    PHASE_PARSE,    // parse_temp_file
+    PHASE_PLAN,     // compute_plan
+    PHASE_EXECUTE,  // execute_plan
+    PHASE_COUNT
+};
+
+static s8 phase_names[PHASE_COUNT] = {
+    s8("list"), s8("sort"), s8("write"), s8("editor"),
+    s8("parse"), s8("plan"), s8("execute"),
+};
+
+typedef struct {
+    i64 ns[PHASE_COUNT];     // wall time per phase
+    iz  bytes[PHASE_COUNT];  // arena bytes allocated per phase
+    iz  peak;                // arena high-water mark
+    i64 fs_lookups;          // fsstate_exists queries in execute_plan
+    i64 fs_hits;             // ... answered from the cache
+} stats;
+
+// File system state tracker to cache OS queries
+enum { PATH_UNKNOWN, PATH_EXISTS, PATH_GONE };
+
+typedef struct {
+    pathtab *paths;      // read only while jobs run
+    u8      *state;      // PATH_* by path id, shared by every worker
+    u32     *dirs;       // by path id, *epoch when known to be a directory
+    u32     *epoch;      // shared, bumped whenever a directory may have moved
+    os      *ctx;
+    i64      lookups;    // fsstate_exists queries
+    i64      hits;       // ... answered without asking the OS
+} fsstate;
+
+static fsstate *new_fsstate(os *ctx, pathtab *paths, u8 *state, u32 *dirs, u32 *epoch, arena *perm)
+{
+    fsstate *fs = new(perm, fsstate, 1);
+    fs->paths = paths;
+    fs->state = state;
+    fs->dirs = dirs;
+    fs->epoch = epoch;
+    fs->ctx = ctx;
+    return fs;
+}
+
+// Workers only write the state of paths their own jobs touch, apart from
+// reservations, which all agree
+static void fsstate_mark_exists(fsstate *fs, pathid id)
+{
+    __atomic_store_n(fs->state + id, PATH_EXISTS, __ATOMIC_RELAXED);
+}
+
+static void fsstate_mark_deleted(fsstate *fs, pathid id)
+{
+    __atomic_store_n(fs->state + id, PATH_GONE, __ATOMIC_RELAXED);
+}
+
+static b32 fsstate_exists(fsstate *fs, pathid id, arena *perm)
+{
+    fs->lookups++;
+    u8 state = __atomic_load_n(fs->state + id, __ATOMIC_RELAXED);
+    if (state != PATH_UNKNOWN) {
+        fs->hits++;
+        return state == PATH_EXISTS;
+    }
+    
+    // First time seeing this path - query OS once and cache result
+    arena scratch = *perm;
+    s8 path = pathtab_get(fs->paths, id, &scratch);
+    b32 file_exists = os_path_exists(fs->ctx, scratch, path);
+    __atomic_store_n(fs->state + id, file_exists ? PATH_EXISTS : PATH_GONE, __ATOMIC_RELAXED);
+    return file_exists;
+}
+
+// Like fsstate_exists, for a path that may not be in the plan
+static b32 fsstate_name_exists(fsstate *fs, s8 path, arena *perm)
+{
+    pathid id = pathtab_find(fs->paths, path);
+    if (id != NO_PATH) {
+        return fsstate_exists(fs, id, perm);
+    }
+    fs->lookups++;
+    return os_path_exists(fs->ctx, *perm, path);
+}
+
+// Ensure the directory holding path exists, asking the OS only the first
+// time a directory is needed. Its ancestors are recorded along with it, so
+// a deep tree is created in one pass and its siblings are not checked again.
+static b32 fsstate_ensure_dir(fsstate *fs, pathid path, arena *perm)
+{
+    pathid dir = fs->paths->ents[path].parent;
+    u32 epoch = __atomic_load_n(fs->epoch, __ATOMIC_RELAXED);
+    if (dir != NO_PATH && __atomic_load_n(fs->dirs + dir, __ATOMIC_RELAXED) == epoch) {
+        return 1;
+    }
+    arena scratch = *perm;
+    s8 name = pathtab_dirname(fs->paths, path, &scratch);
+    if (!os_create_dir(fs->ctx, scratch, name)) {
+        return 0;
+    }
+    for (; dir != NO_PATH; dir = fs->paths->ents[dir].parent) {
+        if (__atomic_load_n(fs->dirs + dir, __ATOMIC_RELAXED) == epoch) {
+            break;  // so are its ancestors
+        }
+        __atomic_store_n(fs->dirs + dir, epoch, __ATOMIC_RELAXED);
+    }
+    return 1;
+}
+
+// Forget every known directory, after one may have moved or gone away
+static void fsstate_forget_dirs(fsstate *fs)
+{
+    __atomic_add_fetch(fs->epoch, 1, __ATOMIC_RELAXED);
+}
+
+// Generate a unique non-conflicting name for a file
+static s8 fsstate_unique_name(fsstate *fs, s8 base_path, arena *perm)
+{
+    if (!fsstate_name_exists(fs, base_path, perm)) {
+        return base_path;  // No conflict
+    }
+    
+    // Try base_path~, base_path~1, base_path~2, etc.
+    iz max_len = base_path.len + 20;  // Room for ~999999...
+    u8 *candidate = newnz(perm, u8, max_len);
+    
+    // Copy base path
+    for (iz i = 0; i < base_path.len; i++) {
+        candidate[i] = base_path.s[i];
+    }
+    candidate[base_path.len] = '~';
+    
+    s8 candidate_path = {candidate, base_path.len + 1};
+    if (!fsstate_name_exists(fs, candidate_path, perm)) {
+        return candidate_path;
+    }
+    
+    // Try with numbers
+    for (i32 counter = 1; ; counter++) {
+        iz pos = base_path.len + 1;
+        i32 temp_counter = counter;
+        
+        // Convert counter to digits
+        u8 digits[16];
+        iz digit_count = 0;
+        do {
+            digits[digit_count++] = '0' + (temp_counter % 10);
+            temp_counter /= 10;
+        } while (temp_counter > 0);
+        
+        // Copy digits in correct order
+        for (iz i = 0; i < digit_count; i++) {
+            candidate[pos + i] = digits[digit_count - 1 - i];
+        }
+        
+        candidate_path.len = pos + digit_count;
+        if (!fsstate_name_exists(fs, candidate_path, perm)) {
+            return candidate_path;
+        }
+        
+        // Prevent overflow
+        if (counter == 0x7fffffff) {  // INT32_MAX
+            return base_path;  // Just give up...
+        }
+    }
+}
+
+static void os_write(os *, i32 fd, s8);
+static i32  os_read(os *, i32 fd, u8 *, i32);
+static i32  os_path_type(os *ctx, arena scratch, s8 path);
+static b32  os_path_exists(os *ctx, arena scratch, s8 path);
+static s8node *os_list_dir(os *ctx, arena *perm, s8 path);
+
+// List everything below path, unsorted, descending at most maxdepth levels
+// (0 for no limit). Symbolic links to directories are not followed.
+static s8node *os_walk_dir(os *ctx, arena *perm, s8 path, i32 maxdepth);
+
+static b32  os_invoke_editor(os *ctx, arena scratch);
+static void os_close_temp_file(os *ctx);
+// Contents of the edited temp file, mapped read-only where possible and
+// otherwise read whole into perm. Valid until os_remove_temp_file.
+static s8   os_map_temp_file(os *ctx, arena *perm);
+static void os_remove_temp_file(os *ctx);
+// Like os_map_temp_file for any file, valid until exit. Null on failure.
+static s8   os_read_file(os *ctx, arena *perm, s8 path);
+static b32  os_write_file(os *ctx, arena scratch, s8 path, s8 data);
+
+// The journal of --journal, --resume and --rollback, appended to as fd 4
+// with os_write from any thread. Writes are durable once synced.
+static b32  os_open_journal(os *ctx, arena scratch, s8 path, b32 create);
+static b32  os_sync_journal(os *ctx);
+
+// Types are FT_* values from the listing (FT_UNKNOWN when not known). The
+// platform may cache state about directories that these operations move.
+static b32  os_rename_file(os *ctx, arena scratch, s8 src, s8 dst, i32 type);
+static b32  os_delete_path(os *ctx, arena scratch, s8 path, i32 type);
+
+// A rename (dst set) or delete for os_run_batch
+typedef struct {
+    s8  src;
+    s8  dst;
+    i32 type;  // FT_* of src, never FT_UNKNOWN for deletes
+    b32 ok;    // set on return
+} osop;
+
+// Run operations that touch unrelated paths, in any order or all at once.
+// Returns 0 without running any when the platform cannot batch, leaving
+// the caller to run them one at a time.
+static b32  os_run_batch(os *ctx, arena scratch, osop *ops, iz n);
+static void os_exit(os *ctx, i32 code);
+static i64  os_clock(os *ctx);
+static oscounters *os_counters(os *ctx);
+
+typedef struct {
+    arena *perm;
+    os    *ctx;
+    u8    *buf;
+    iz     len;
+    iz     cap;
+    i32    fd;
+} u8buf;
+
+static u8buf *newfdbuf(arena *perm, i32 fd, iz cap)
+{
+    u8buf *b = new(perm, u8buf, 1);
+    b->cap = cap;
+    b->buf = newnz(perm, u8, cap);
+    b->fd  = fd;
+    b->ctx = perm->ctx;
+    return b;
 }
 
 static s8 gets8(u8buf *b)
@@ -506,22 +1452,24 @@ static void printi64(u8buf *b, i64 x)
     prints8(b, numstr);
 }
 
-// Add a leading "./" to a relative path for display and stable matching
-static s8 prepend_dot_slash(arena *perm, s8 path)
+// Intern path as displayed, with a leading "./" on a relative path for
+// stable matching. The "./" is a directory entry rather than a copy.
+// Without perm, only look it up.
+static pathid pathtab_intern_display(pathtab *t, s8 path, arena *perm, b32 copy)
 {
     if (path.len >= 2 && path.s[0] == '.' && (path.s[1] == '/' || path.s[1] == '\\')) {
-        return path; // already has ./ or .\\ form
+        return pathtab_intern(t, path, perm, copy); // already has ./ or .\\ form
     }
     // Absolute paths (starts with '/' or a Windows drive like 'C:') stay unchanged
     if ((path.len >= 1 && (path.s[0] == '/' || path.s[0] == '\\')) ||
         (path.len >= 2 && ((path.s[1] == ':' && ((path.s[0] >= 'A' && path.s[0] <= 'Z') || (path.s[0] >= 'a' && path.s[0] <= 'z')))))) {
-        return path;
+        return pathtab_intern(t, path, perm, copy);
+    }
+    pathid dot = pathtab_child(t, NO_PATH, 0, S("."), perm, 0);
+    if (dot == NO_PATH) {
+        return NO_PATH;  // looked up only, and nothing is under "."
     }
-    u8 *p = new(perm, u8, path.len + 2);
-    p[0] = '.';
-    p[1] = '/';
-    for (iz i = 0; i < path.len; i++) p[2 + i] = path.s[i];
-    return (s8){p, path.len + 2};
+    return pathtab_path_(t, dot, '/', path, perm, copy);
 }
 
 // Input buffer for reading from stdin
@@ -536,15 +1484,50 @@ typedef struct {
     b32    eof;
 } u8input;
 
-// Parse the temporary file into an array of names. Returns an array of exactly
-// original_name_count items. Missing items (to be deleted) are null.
-static s8 *parse_temp_file(arena *perm, u8input *input, iz original_name_count, u8buf *err);
+// The numbered listing, exactly as written to the temp file
+typedef struct {
+    s8      text;
+    iz     *lines;  // offset of each line in text, then text.len
+    pathid *ids;    // path named on each line
+    i32    *types;  // FT_* of each line
+    iz      len;
+    u32    *owner;  // line naming each of the first nowners ids, or -1
+    iz      nowners;
+} listing;
 
-// Produce a sequence of operations necessary to achieve the new name set.
-static Plan compute_plan(arena *perm, s8 *oldnames, s8 *newnames, iz num_names);
+// Lines whose name the edit changed, in listing order
+typedef struct {
+    iz     *items;  // line in the listing
+    pathid *ids;    // new name, or NO_PATH to delete
+    iz      len;
+} changes;
 
-// Execute the plan 
-static b32 execute_plan(Plan plan, arena scratch, os *ctx, u8buf *out, u8buf *err, b32 verbose);
+// Parse the edited temp file contents against the listing into the
+// changes it makes, with names interned in paths. These refer into text
+// rather than copying it, so text must outlive paths. Lines missing from
+// the edit are deleted.
+static changes parse_temp_file(arena *perm, pathtab *paths, listing *orig, s8 text, u8buf *err);
+
+// Produce a sequence of operations taking the listing to its changed
+// names. Work and memory follow the number of changes, not the listing.
+static Plan compute_plan(arena *perm, pathtab *paths, listing *orig, changes ch);
+
+enum { JOURNAL_NONE, JOURNAL_NEW, JOURNAL_APPEND };
+
+// How execute_plan runs the actions
+typedef struct {
+    b32 verbose;  // report each action on out
+    b32 batch;    // hand runs of independent actions to the platform at once
+    i32 jobs;     // run independent units on this many threads
+    i32 journal;  // JOURNAL_*: log actions to fd 4 first, after the plan if new
+    b32 undo;     // the actions revert those of the journal
+    u8 *skip;     // by action, already carried out by an earlier run
+    iz *ids;      // journal index of each action, when not its own
+    s8 *temps;    // by action, temporary names from the journal, not fresh ones
+} execopts;
+
+// Execute the plan, recording arena and cache usage in st
+static b32 execute_plan(Plan plan, arena scratch, os *ctx, u8buf *out, u8buf *err, execopts opts, stats *st);
 
 // Parse a line from temp file: "number\tpath"
 static b32 parse_temp_line(s8 *line, i32 *line_number);
@@ -554,7 +1537,7 @@ static u8input *newinput(arena *perm, i32 fd, iz cap)
     u8input *b = new(perm, u8input, 1);
     b->perm = perm;
     b->cap = cap;
-    b->buf = new(perm, u8, cap);
+    b->buf = newnz(perm, u8, cap);
     b->fd  = fd;
     b->ctx = perm->ctx;
     return b;
@@ -593,13 +1576,12 @@ static s8 nextline(u8input *b)
 {
     while (!b->eof) {
         // Look for newline in current buffer
-        for (iz i = b->pos; i < b->len; i++) {
-            if (b->buf[i] == '\n') {
-                iz line_len = i - b->pos;
-                s8 line = {b->buf + b->pos, line_len};
-                b->pos = i + 1;  // Skip the newline
-                return line;
-            }
+        s8 rest = {b->buf + b->pos, b->len - b->pos};
+        iz line_len = s8index(rest, '\n');
+        if (line_len < rest.len) {
+            s8 line = {rest.s, line_len};
+            b->pos += line_len + 1;  // Skip the newline
+            return line;
         }
         
         // No newline found, need more data
@@ -608,7 +1590,7 @@ static s8 nextline(u8input *b)
         } else if (b->len == b->cap) {
             // Buffer full but no newline - allocate larger buffer
             iz new_cap = b->cap * 2;
-            u8 *new_buf = new(b->perm, u8, new_cap);
+            u8 *new_buf = newnz(b->perm, u8, new_cap);
             for (iz i = 0; i < b->len; i++) {
                 new_buf[i] = b->buf[i];
             }
@@ -631,69 +1613,404 @@ static s8 nextline(u8input *b)
     return (s8){0};
 }
 
-// Parse the temporary file into an array of names. Returns an array of exactly
-// original_name_count items. Missing items (to be deleted) are null.
-static s8 *parse_temp_file(arena *perm, u8input *input, iz original_name_count, u8buf *err)
+// Sort a ascending
+static void u64sort(u64 *a, iz n, arena scratch)
 {
-    s8 *names = new(perm, s8, original_name_count);
-    // Track duplicate item numbers
-    u32 *seen = new(perm, u32, bitarray_size(original_name_count));
-    
-    for (;;) {
-        s8 line = nextline(input);
-        if (line.len == 0 && line.s == 0) break;  // EOF
-        
+    u64 *tmp = newnz(&scratch, u64, n);
+    u64 *src = a;
+    for (iz width = 1; width < n; width *= 2) {
+        for (iz lo = 0; lo < n; lo += 2*width) {
+            iz mid = lo+width < n ? lo+width : n;
+            iz hi = lo+2*width < n ? lo+2*width : n;
+            iz i = lo, j = mid, k = lo;
+            while (i < mid && j < hi) {
+                tmp[k++] = src[j] < src[i] ? src[j++] : src[i++];
+            }
+            while (i < mid) tmp[k++] = src[i++];
+            while (j < hi)  tmp[k++] = src[j++];
+        }
+        u64 *swap = src;
+        src = tmp;
+        tmp = swap;
+    }
+    if (src != a) {
+        for (iz i = 0; i < n; i++) {
+            a[i] = src[i];
+        }
+    }
+}
+
+// Index of item in the ascending items[0, n), or NOT_FOUND
+static iz find_item_(iz *items, iz n, iz item)
+{
+    iz lo = 0, hi = n;
+    while (lo < hi) {
+        iz mid = lo + (hi - lo)/2;
+        if (items[mid] < item) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < n && items[lo] == item ? lo : NOT_FOUND;
+}
+
+enum { PARSE_CHUNK = 1 << 20 };  // bytes of temp file per task when parsing in parallel
+
+// Why parsing stopped, reported as the serial parse always has
+enum { PARSE_OK, PARSE_BADLINE, PARSE_UNKNOWN, PARSE_DUPLICATE };
+
+// A parsed line that differs from the listing. A name that was not yet in
+// the table, left for the caller to intern, has id NO_PATH.
+typedef struct {
+    iz     off;   // of the line in the temp file
+    u32    item;  // listed line it names
+    pathid id;
+} parsedline;
+
+typedef struct {
+    parsedline *lines;
+    iz          len;
+    iz          cap;
+    i32         status;
+} parsedlines;
+
+typedef struct {
+    listing     *orig;
+    pathtab     *paths;
+    s8           text;
+    u32         *seen;    // item numbers seen so far, claimed atomically
+    iz          *bounds;  // chunk k is text[bounds[k], bounds[k+1])
+    parsedlines *chunks;
+    arena       *arenas;  // one per thread
+    i32          nchunks;
+    i32          next;    // next chunk to claim
+    i32          failed;  // set on the first error, stopping every thread
+} parsejob;
+
+// Parse text[beg, end) against the listing into out, allocated in perm.
+// Runs of lines left as listed are recognized by comparing whole words
+// against the listing, and skipped without being parsed. New names are
+// interned in perm when intern is set, and otherwise only looked up, so
+// that several threads may share the table.
+static i32 parse_lines_(parsejob *job, iz beg, iz end, arena *perm, b32 intern, parsedlines *out)
+{
+    listing *orig = job->orig;
+    s8 text = {job->text.s + beg, end - beg};
+    iz next = 0;  // listed line most likely to come next
+    while (text.len) {
+        if (next < orig->len) {
+            iz start = orig->lines[next];
+            s8 listed = {orig->text.s + start, orig->text.len - start};
+            iz same = start + s8mismatch(text, listed);
+
+            // Last listed line ending within the common prefix
+            iz lo = next, hi = orig->len;
+            while (lo < hi) {
+                iz mid = lo + (hi - lo + 1)/2;
+                if (orig->lines[mid] <= same) {
+                    lo = mid;
+                } else {
+                    hi = mid - 1;
+                }
+            }
+            if (lo > next) {
+                if (!bitarray_claim(job->seen, next, lo)) {
+                    return PARSE_DUPLICATE;
+                }
+                text.s += orig->lines[lo] - start;
+                text.len -= orig->lines[lo] - start;
+                next = lo;
+                continue;
+            }
+        }
+
+        iz off = text.s - job->text.s;
+        iz eol = s8index(text, '\n');
+        s8 line = takehead(text, eol);
+        eol += eol < text.len;  // Skip the newline
+        text.s += eol;
+        text.len -= eol;
+
         // Skip empty lines
         if (line.len == 0) continue;
         
         i32 parsed_line_num;
         s8 line_copy = line;
         if (!parse_temp_line(&line_copy, &parsed_line_num)) {
+            return PARSE_BADLINE;
+        }
+        
+        // Check if line number is in valid range [1, orig->len]
+        if (parsed_line_num < 1 || parsed_line_num > orig->len) {
+            return PARSE_UNKNOWN;
+        }
+        
+        // Convert to 0-based index, normalizing the path
+        iz idx = (iz)(parsed_line_num - 1);
+        if (!bitarray_claim(job->seen, idx, idx+1)) {
+            return PARSE_DUPLICATE;
+        }
+
+        // Components not already listed refer into text
+        pathid id = intern
+            ? pathtab_intern_display(job->paths, line_copy, perm, 0)
+            : pathtab_intern_display(job->paths, line_copy, 0, 0);
+        if (id != orig->ids[idx]) {
+            if (out->len == out->cap) {
+                out->lines = push_(perm, out->lines, &out->cap, sizeof(parsedline), _Alignof(parsedline));
+            }
+            out->lines[out->len++] = (parsedline){off, (u32)idx, id};
+        }
+        next = idx + 1;
+    }
+    return PARSE_OK;
+}
+
+static void parse_worker_(void *arg, i32 id)
+{
+    parsejob *job = arg;
+    arena *perm = job->arenas + id;
+    while (!__atomic_load_n(&job->failed, __ATOMIC_RELAXED)) {
+        i32 k = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (k >= job->nchunks) return;
+        parsedlines *out = job->chunks + k;
+        out->status = parse_lines_(job, job->bounds[k], job->bounds[k+1], perm, 0, out);
+        if (out->status != PARSE_OK) {
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Parse the edited temp file contents against the listing into the
+// changes it makes. Only the lines that differ are recorded, so the
+// result, like the work, follows the size of the edit. A large file is
+// split at line boundaries and parsed on every core, interning the new
+// names afterwards in file order. On an error it is parsed again
+// serially, to report the first error just as the serial parse would.
+static changes parse_temp_file(arena *perm, pathtab *paths, listing *orig, s8 text, u8buf *err)
+{
+    parsejob job = {0};
+    job.orig = orig;
+    job.paths = paths;
+    job.text = text;
+    job.seen = new(perm, u32, bitarray_size(orig->len));
+    byte *limit = perm->limit;
+
+    i32 nthreads = os_ncpu(perm->ctx);
+    iz nchunks = text.len / PARSE_CHUNK;
+    nchunks = nchunks > nthreads*4 ? nthreads*4 : nchunks;
+    if (nthreads > 1 && nchunks > 1) {
+        job.nchunks = (i32)nchunks;
+        job.bounds = newnz(perm, iz, nchunks+1);
+        job.chunks = new(perm, parsedlines, nchunks);
+        job.bounds[0] = 0;
+        for (iz k = 1; k < nchunks; k++) {
+            iz at = text.len / nchunks * k;
+            at = at > job.bounds[k-1] ? at : job.bounds[k-1];
+            s8 rest = {text.s + at, text.len - at};
+            iz eol = s8index(rest, '\n');
+            job.bounds[k] = at + eol + (eol < rest.len);
+        }
+        job.bounds[nchunks] = text.len;
+
+        // Records stay in the threads' arenas, below whose slices perm
+        // is limited until they are gathered
+        job.arenas = newnz(perm, arena, nthreads);
+        nthreads = arena_split(perm, job.arenas, nthreads);
+        os_parallel(perm->ctx, nthreads, parse_worker_, &job);
+        arena_join(perm, job.arenas, nthreads);
+
+        if (job.failed) {
+            // Nothing in the slices is kept, so reparse with all of perm
+            perm->limit = limit;
+            u32 *seen = job.seen;
+            for (iz w = 0; w < bitarray_size(orig->len); w++) {
+                seen[w] = 0;
+            }
+            job.nchunks = 0;
+        }
+    }
+
+    if (!job.nchunks) {
+        job.nchunks = 1;
+        job.bounds = newnz(perm, iz, 2);
+        job.bounds[0] = 0;
+        job.bounds[1] = text.len;
+        job.chunks = new(perm, parsedlines, 1);
+        job.chunks->status = parse_lines_(&job, 0, text.len, perm, 1, job.chunks);
+        switch (job.chunks->status) {
+        case PARSE_OK:
+            break;
+        case PARSE_BADLINE:
             prints8(err, S("vidir: unable to parse line, aborting\n"));
             flush(err);
             os_exit(perm->ctx, 1);
-        }
-        
-        // Check if line number is in valid range [1, original_name_count]
-        if (parsed_line_num < 1 || parsed_line_num > original_name_count) {
+            break;
+        case PARSE_UNKNOWN:
             prints8(err, S("vidir: unknown item number\n"));
             flush(err);
             os_exit(perm->ctx, 1);
-        }
-        
-        // Copy the path to permanent memory
-        u8 *path_copy = new(perm, u8, line_copy.len + 1);
-        for (iz i = 0; i < line_copy.len; i++) {
-            path_copy[i] = line_copy.s[i];
-        }
-        path_copy[line_copy.len] = 0;  // null terminate
-        
-        // Store in the array (convert to 0-based index), normalizing the path
-        iz idx = (iz)(parsed_line_num - 1);
-        if (bitarray_get(seen, idx)) {
+            break;
+        case PARSE_DUPLICATE:
             prints8(err, S("vidir: duplicate item number in temp file\n"));
             flush(err);
             os_exit(perm->ctx, 1);
+            break;
         }
-        bitarray_set(seen, idx);
-        s8 parsed_path = {path_copy, line_copy.len};
-        names[idx] = prepend_dot_slash(perm, parsed_path);
     }
-    
-    return names;
+
+    // Intern the new names in file order, then order the changes by line
+    iz nparsed = 0;
+    for (i32 k = 0; k < job.nchunks; k++) {
+        nparsed += job.chunks[k].len;
+    }
+    u64 *parsed = newnz(perm, u64, nparsed);  // line<<32 | new name
+    nparsed = 0;
+    for (i32 k = 0; k < job.nchunks; k++) {
+        parsedlines *c = job.chunks + k;
+        for (iz i = 0; i < c->len; i++) {
+            parsedline p = c->lines[i];
+            if (p.id == NO_PATH) {
+                s8 line = {text.s + p.off, text.len - p.off};
+                line.len = s8index(line, '\n');
+                i32 num;
+                parse_temp_line(&line, &num);
+                p.id = pathtab_intern_display(paths, line, perm, 0);
+            }
+            parsed[nparsed++] = (u64)p.item<<32 | p.id;
+        }
+    }
+    u64sort(parsed, nparsed, *perm);
+    perm->limit = limit;
+
+    // Lines missing from the edit are deleted
+    u32 *seen = job.seen;
+    iz nwords = bitarray_size(orig->len);
+    iz ndeleted = orig->len;
+    for (iz w = 0; w < nwords; w++) {
+        ndeleted -= __builtin_popcount(seen[w]);
+    }
+
+    changes r = {0};
+    r.items = newnz(perm, iz, nparsed + ndeleted);
+    r.ids = newnz(perm, pathid, nparsed + ndeleted);
+    iz k = 0;
+    for (iz w = 0; w < nwords; w++) {
+        u32 missing = ~seen[w];
+        if (w == nwords-1 && orig->len%32) {
+            missing &= ((u32)1 << orig->len%32) - 1;
+        }
+        for (; missing; missing &= missing - 1) {
+            iz item = w*32 + __builtin_ctz(missing);
+            for (; k < nparsed && (iz)(parsed[k]>>32) < item; k++) {
+                r.items[r.len] = (iz)(parsed[k]>>32);
+                r.ids[r.len++] = (pathid)parsed[k];
+            }
+            r.items[r.len] = item;
+            r.ids[r.len++] = NO_PATH;
+        }
+    }
+    for (; k < nparsed; k++) {
+        r.items[r.len] = (iz)(parsed[k]>>32);
+        r.ids[r.len++] = (pathid)parsed[k];
+    }
+    return r;
 }
 
 // Produce a sequence of operations necessary to achieve the new name set.
 // Helper: append an action to a plan using the push macro
-static void plan_append(arena *perm, Plan *p, Op op, s8 src, s8 dst)
+static void plan_append(arena *perm, Plan *p, Op op, pathid src, pathid dst, i32 type)
+{
+    *plan_push(perm, p) = (Action){op, src, dst, type};
+}
+
+// Helper: start a new unit at the next action
+static void plan_begin_unit(arena *perm, Plan *p)
+{
+    if (p->nunits == p->units_cap) {
+        p->units = push_(perm, p->units, &p->units_cap, sizeof(iz), _Alignof(iz));
+    }
+    p->units[p->nunits++] = p->len;
+}
+
+// Line of the listing currently naming id, or NOT_FOUND
+static iz listing_owner_(listing *l, pathid id)
+{
+    return (iz)id < l->nowners && l->owner[id] != (u32)-1 ? (iz)l->owner[id] : NOT_FOUND;
+}
+
+// Value paired with key in pairs[0, n) of key<<32 | value, ascending, or
+// NOT_FOUND
+static iz find_pair_(u64 *pairs, iz n, u32 key)
+{
+    iz lo = 0, hi = n;
+    while (lo < hi) {
+        iz mid = lo + (hi - lo)/2;
+        if ((u32)(pairs[mid]>>32) < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < n && (u32)(pairs[lo]>>32) == key ? (iz)(u32)pairs[lo] : NOT_FOUND;
+}
+
+// The edit's renames, by old and by new name, as path<<32 | change
+typedef struct {
+    pathtab *paths;
+    u64     *from;
+    u64     *to;
+    iz       len;
+    pathid  *olds;     // by change
+    pathid  *dests;    // by change
+    u8      *carries;  // by change, set once another path depends on it
+} renames;
+
+// Where the listed path old is found once every renamed directory above
+// it has moved: beneath the new name of the nearest
+static pathid renames_source_(renames *r, pathid old, arena *perm)
+{
+    pathent *ents = r->paths->ents;
+    for (pathid dir = ents[old].parent; dir != NO_PATH; dir = ents[dir].parent) {
+        iz k = find_pair_(r->from, r->len, dir);
+        if (k != NOT_FOUND) {
+            r->carries[k] = 1;
+            return pathtab_rebase(r->paths, old, dir, r->dests[k], perm);
+        }
+    }
+    return old;
+}
+
+// Line of the listing whose entry is found at path once renamed
+// directories have moved, or NOT_FOUND. It may have been listed there, or
+// beneath the old name of a directory renamed to one above path.
+static iz renames_owner_(renames *r, listing *orig, pathid path)
 {
-    *plan_push(perm, p) = (Action){op, src, dst};
+    pathid cand = path;
+    for (pathid dir = path;;) {
+        iz item = cand == NO_PATH ? NOT_FOUND : listing_owner_(orig, cand);
+        if (item != NOT_FOUND && renames_source_(r, cand, 0) == path) {
+            return item;
+        }
+        dir = r->paths->ents[dir].parent;
+        if (dir == NO_PATH) {
+            return NOT_FOUND;
+        }
+        iz k = find_pair_(r->to, r->len, dir);
+        cand = NO_PATH;
+        if (k != NOT_FOUND) {
+            r->carries[k] = 1;  // path is only there once it has moved
+            cand = pathtab_rebase(r->paths, path, dir, r->olds[k], 0);
+        }
+    }
 }
 
-static Plan compute_plan(arena *perm, s8 *oldnames, s8 *newnames, iz num_names)
+static Plan compute_plan(arena *perm, pathtab *paths, listing *orig, changes ch)
 {
 /* 
- * For each file, construct a dependency graph:
+ * For each changed entry, and each unchanged entry in the way of one,
+ * construct a dependency graph:
  *   - deps[i]   : index of the file currently blocking file i's target (NO_DEPENDENCY if free)
  *   - rdeps[i]  : index of the file waiting for file i to move (NO_DEPENDENCY if none)
  *
@@ -704,118 +2021,199 @@ static Plan compute_plan(arena *perm, s8 *oldnames, s8 *newnames, iz num_names)
  *   - Break cycles by temporarily stashing the starting file.
  *   - Resolve the chain backwards via rdeps[] to emit operations in correct order.
  *
+ * Old names are found through the listing's owner index, so nothing here
+ * grows with the listing, only with the number of changes.
  */
     
     Plan plan = (Plan){0};
+    plan.paths = paths;
 
-    if (num_names <= 0) return plan;
-
-    // Build lookup map from old names to indices
-    pathmap *oldmap = 0;
-    for (iz i = 0; i < num_names; i++) {
-        if (oldnames[i].s && oldnames[i].len > 0) {
-            iz *slot = pathmap_insert(&oldmap, oldnames[i], perm);
-            *slot = i;
-        }
-    }
-
-    // Build dependency graph
-    // deps[i] = index of file that must move before file i can move (NO_DEPENDENCY if none)
-    // rdeps[i] = index of file that's waiting for file i to move (NO_DEPENDENCY if none)
-    iz *deps = new(perm, iz, num_names);
-    iz *rdeps = new(perm, iz, num_names);
-    for (iz i = 0; i < num_names; i++) {
-        deps[i] = rdeps[i] = NO_DEPENDENCY;
-    }
+    iz nchanges = ch.len;
+    if (nchanges <= 0) return plan;
 
     // Handle duplicate targets: last one wins, earlier ones get ~ suffixes
-    s8 *final_dest = new(perm, s8, num_names);
+    pathid *change_dest = newnz(perm, pathid, nchanges);
     {
-        dup_target_map *dup_map = 0;  // Maps target -> (last_idx, dup_count)
-        
-        // Find last occurrence of each target
-        for (iz i = 0; i < num_names; i++) {
-            final_dest[i] = newnames[i];  // Default: use original target
-            s8 n = newnames[i];
-            if (n.s && n.len && !s8equals(oldnames[i], n)) {
-                dup_target *info = dup_target_map_insert(&dup_map, n, perm);
-                info->last_idx = i;
+        // Sorted by target, each target's changes are together and in order
+        u64 *keys = newnz(perm, u64, nchanges);
+        iz nkeys = 0;
+        for (iz k = 0; k < nchanges; k++) {
+            change_dest[k] = ch.ids[k];  // Default: use original target
+            if (ch.ids[k] != NO_PATH) {
+                keys[nkeys++] = (u64)ch.ids[k]<<32 | (u64)k;
+            }
+        }
+        u64sort(keys, nkeys, *perm);
+        iz *dup_count = new(perm, iz, nchanges);  // Duplicates seen before, plus one
+        for (iz beg = 0, end; beg < nkeys; beg = end) {
+            for (end = beg+1; end < nkeys && keys[end]>>32 == keys[beg]>>32; end++) {}
+            for (iz j = beg; j < end-1; j++) {
+                dup_count[(u32)keys[j]] = j - beg + 1;  // not the last occurrence
             }
         }
         
         // Assign ~ suffixes to duplicates (all but last occurrence)
-        for (iz i = 0; i < num_names; i++) {
-            s8 target = newnames[i];
-            // Skip non-moves
-            if (s8equals(oldnames[i], target) || !target.s || !target.len) continue;
-            
-            dup_target *info = dup_target_map_lookup(&dup_map, target);
-            if (!info || info->last_idx == i) continue;  // Not found or last occurrence
+        for (iz k = 0; k < nchanges; k++) {
+            if (!dup_count[k]) continue;
             
             // This is an earlier duplicate - add ~ suffix
-            if (info->dup_count == NOT_FOUND) info->dup_count = 0;  // Initialize counter
-            iz suffix_num = info->dup_count++;
+            iz suffix_num = dup_count[k] - 1;
+            pathent target = paths->ents[ch.ids[k]];
             
-            // Build final path: target~ or target~N
+            // Build final name: target~ or target~N, beside the target
             iz suffix_len = 1;  // For '~'
             if (suffix_num > 0) {
                 // Count digits in suffix_num
                 for (iz n = suffix_num; n > 0; n /= 10) suffix_len++;
             }
             
-            u8 *path = new(perm, u8, target.len + suffix_len);
-            for (iz j = 0; j < target.len; j++) path[j] = target.s[j];
-            path[target.len] = '~';
+            u8 *name = newnz(perm, u8, target.len + suffix_len);
+            for (iz j = 0; j < target.len; j++) name[j] = target.name[j];
+            name[target.len] = '~';
             
             if (suffix_num > 0) {
                 // Write digits in reverse
                 iz pos = target.len + suffix_len - 1;
                 for (iz n = suffix_num; n > 0; n /= 10) {
-                    path[pos--] = '0' + (n % 10);
+                    name[pos--] = '0' + (n % 10);
                 }
             }
             
-            final_dest[i] = (s8){path, target.len + suffix_len};
+            s8 suffixed = {name, target.len + suffix_len};
+            change_dest[k] = pathtab_child(paths, target.parent, target.sep, suffixed, perm, 0);
+        }
+    }
+
+    // An entry listed beneath a renamed directory is found under the
+    // directory's new name once that has moved, so its own action starts
+    // there, and it stays put when its new name is that one, as after a
+    // global substitution over a recursive listing. Paths are looked up
+    // as they will be then, and renames carrying others along go first.
+    renames rn = {0};
+    rn.paths = paths;
+    rn.from = newnz(perm, u64, nchanges);
+    rn.to = newnz(perm, u64, nchanges);
+    rn.olds = newnz(perm, pathid, nchanges);
+    rn.dests = change_dest;
+    rn.carries = new(perm, u8, nchanges);
+    for (iz k = 0; k < nchanges; k++) {
+        rn.olds[k] = orig->ids[ch.items[k]];
+        if (change_dest[k] != NO_PATH && change_dest[k] != rn.olds[k]) {
+            rn.from[rn.len] = (u64)rn.olds[k]<<32 | (u64)k;
+            rn.to[rn.len++] = (u64)change_dest[k]<<32 | (u64)k;
         }
     }
+    u64sort(rn.from, rn.len, *perm);
+    u64sort(rn.to, rn.len, *perm);
+    pathid *change_src = newnz(perm, pathid, nchanges);
+    for (iz k = 0; k < nchanges; k++) {
+        change_src[k] = rn.len ? renames_source_(&rn, rn.olds[k], perm) : rn.olds[k];
+    }
+
+    // Unchanged entries in the way of a change join the graph as non-moves
+    u64 *blockers = newnz(perm, u64, nchanges);
+    iz nblockers = 0;
+    for (iz k = 0; k < nchanges; k++) {
+        if (change_dest[k] == NO_PATH || change_dest[k] == change_src[k]) continue;
+        iz blocker = renames_owner_(&rn, orig, change_dest[k]);
+        if (blocker != NOT_FOUND && find_item_(ch.items, nchanges, blocker) == NOT_FOUND) {
+            blockers[nblockers++] = (u64)blocker;
+        }
+    }
+    u64sort(blockers, nblockers, *perm);
+
+    // Both in listing order, as the graph's entries
+    iz num_names = 0;
+    iz cap = nchanges + nblockers;
+    iz *items = newnz(perm, iz, cap);
+    pathid *oldids = newnz(perm, pathid, cap);
+    i32 *oldtypes = newnz(perm, i32, cap);
+    pathid *final_dest = newnz(perm, pathid, cap);
+    u8 *first = new(perm, u8, cap);
+    for (iz k = 0, b = 0; k < nchanges || b < nblockers;) {
+        iz item;
+        if (b == nblockers || (k < nchanges && ch.items[k] < (iz)blockers[b])) {
+            item = ch.items[k];
+            oldids[num_names] = change_src[k];
+            final_dest[num_names] = change_dest[k];
+            first[num_names] = rn.carries[k];
+            k++;
+        } else {
+            item = (iz)blockers[b++];
+            oldids[num_names] = rn.len ? renames_source_(&rn, orig->ids[item], perm) : orig->ids[item];
+            final_dest[num_names] = oldids[num_names];
+            for (; b < nblockers && (iz)blockers[b] == item; b++) {}
+        }
+        items[num_names] = item;
+        oldtypes[num_names] = orig->types[item];
+        num_names++;
+    }
+
+    // Build dependency graph
+    // deps[i] = index of file that must move before file i can move (NO_DEPENDENCY if none)
+    // rdeps[i] = index of file that's waiting for file i to move (NO_DEPENDENCY if none)
+    iz *deps = newnz(perm, iz, num_names);
+    iz *rdeps = newnz(perm, iz, num_names);
+    for (iz i = 0; i < num_names; i++) {
+        deps[i] = rdeps[i] = NO_DEPENDENCY;
+    }
 
     // Build dependency relationships
     for (iz i = 0; i < num_names; i++) {
-        s8 dest = final_dest[i];
-        if (!dest.s || dest.len == 0 || s8equals(oldnames[i], dest)) {
+        pathid dest = final_dest[i];
+        if (dest == NO_PATH || dest == oldids[i]) {
             continue;  // Skip deletes and non-moves
         }
 
         // Check if destination is currently occupied by another file
-        iz *blocker = pathmap_lookup(&oldmap, dest);
-        if (blocker && *blocker != i) {
-            // File i depends on file *blocker moving first
-            deps[i] = *blocker;
-            rdeps[*blocker] = i;
+        iz owner = renames_owner_(&rn, orig, dest);
+        iz blocker = owner == NOT_FOUND ? NOT_FOUND : find_item_(items, num_names, owner);
+        if (blocker != NOT_FOUND && blocker != i) {
+            // File i depends on file blocker moving first
+            deps[i] = blocker;
+            rdeps[blocker] = i;
         }
     }
 
+    // Directory deletes wait until everything else has moved, so entries
+    // listed inside can be deleted or moved out first. So do chains ending
+    // at one, held for a third pass.
+    iz *dir_deletes = newnz(perm, iz, num_names);
+    iz num_dir_deletes = 0;
+    b32 held = 0;
+
     u32 *processed = new(perm, u32, bitarray_size(num_names));
-    for (iz i = 0; i < num_names; i++) {
+    for (iz n = 0; n < (held ? 3 : 2)*num_names; n++) {
+        iz i = n % num_names;
+        if (n < num_names && !first[i]) continue;  // Not yet: others first
         if (bitarray_get(processed, i)) continue;  // Already handled this file
 
         // Handle deletes first
-        if (!final_dest[i].s || final_dest[i].len == 0) {
-            plan_append(perm, &plan, OP_DELETE, oldnames[i], (s8){0});
+        if (final_dest[i] == NO_PATH) {
+            if (oldtypes[i] == FT_DIR) {
+                if (n < 2*num_names) {
+                    dir_deletes[num_dir_deletes++] = i;  // not again when held
+                }
+                continue;
+            }
+            plan_begin_unit(perm, &plan);
+            plan_append(perm, &plan, OP_DELETE, oldids[i], NO_PATH, oldtypes[i]);
             bitarray_set(processed, i);
             continue;
         }
 
         // Handle non-moves
-        if (s8equals(oldnames[i], final_dest[i])) {
+        if (oldids[i] == final_dest[i]) {
             bitarray_set(processed, i);
             continue;
         }
 
         // Handle files with no dependencies
         if (deps[i] == NO_DEPENDENCY || bitarray_get(processed, deps[i])) {
-            plan_append(perm, &plan, OP_RENAME, oldnames[i], final_dest[i]);
+            plan_begin_unit(perm, &plan);
+            plan_append(perm, &plan, OP_RENAME, oldids[i], final_dest[i], oldtypes[i]);
             bitarray_set(processed, i);
+            if (!plan.longest_chain) plan.longest_chain = 1;
             continue;
         }
 
@@ -825,29 +2223,70 @@ static Plan compute_plan(arena *perm, s8 *oldnames, s8 *newnames, iz num_names)
             last = deps[last];
         }
 
+        if (final_dest[last] == NO_PATH && oldtypes[last] == FT_DIR) {
+            if (n < 2*num_names) {
+                held = 1;
+                continue;
+            }
+            // Deepest first, directories listed beneath it go before it
+            for (iz k = num_dir_deletes - 1; k >= 0; k--) {
+                iz d = dir_deletes[k];
+                if (d == last || bitarray_get(processed, d)) continue;
+                pathid p = paths->ents[oldids[d]].parent;
+                for (; p != NO_PATH && p != oldids[last]; p = paths->ents[p].parent) {}
+                if (p != NO_PATH) {
+                    plan_begin_unit(perm, &plan);
+                    plan_append(perm, &plan, OP_DELETE, oldids[d], NO_PATH, oldtypes[d]);
+                    bitarray_set(processed, d);
+                }
+            }
+        }
+
         b32 cycle_detected = (deps[last] == i);
-        
+        plan_begin_unit(perm, &plan);
+
         if (cycle_detected) {
             // Break the cycle by stashing the starting file
-            plan_append(perm, &plan, OP_STASH, oldnames[i], (s8){0});
+            plan_append(perm, &plan, OP_STASH, oldids[i], NO_PATH, oldtypes[i]);
             bitarray_set(processed, i);
+            plan.cycles++;
         }
 
         // Process dependency chain in execution order
         // Start from the end of the chain and work backwards to the beginning
+        iz chain = 1;  // counting the starting file
         while (last != i) {
-            plan_append(perm, &plan, OP_RENAME, oldnames[last], final_dest[last]);
+            if (final_dest[last] == NO_PATH) {
+                // Chain ends at a delete: it must go before its path is reused
+                plan_append(perm, &plan, OP_DELETE, oldids[last], NO_PATH, oldtypes[last]);
+            } else {
+                plan_append(perm, &plan, OP_RENAME, oldids[last], final_dest[last], oldtypes[last]);
+            }
             bitarray_set(processed, last);
+            chain++;
             last = rdeps[last];  // Move to the file waiting for this one
             if (last == NO_DEPENDENCY) break;  // Chain is broken
         }
+        if (chain > plan.longest_chain) {
+            plan.longest_chain = chain;
+        }
 
         if (cycle_detected) {
             // Complete the cycle by unstashing to final destination
-            plan_append(perm, &plan, OP_UNSTASH, (s8){0}, final_dest[i]);
+            plan_append(perm, &plan, OP_UNSTASH, NO_PATH, final_dest[i], oldtypes[i]);
         } else {
             // No cycle - just rename the starting file
-            plan_append(perm, &plan, OP_RENAME, oldnames[i], final_dest[i]);
+            plan_append(perm, &plan, OP_RENAME, oldids[i], final_dest[i], oldtypes[i]);
+            bitarray_set(processed, i);
+        }
+    }
+
+    // Deepest first: a listing puts directories before their contents
+    for (iz k = num_dir_deletes - 1; k >= 0; k--) {
+        iz i = dir_deletes[k];
+        if (!bitarray_get(processed, i)) {
+            plan_begin_unit(perm, &plan);
+            plan_append(perm, &plan, OP_DELETE, oldids[i], NO_PATH, oldtypes[i]);
             bitarray_set(processed, i);
         }
     }
@@ -857,146 +2296,914 @@ static Plan compute_plan(arena *perm, s8 *oldnames, s8 *newnames, iz num_names)
 
 // Execute the plan 
 
-static b32 execute_plan(Plan plan, arena scratch, os *ctx, u8buf *out, u8buf *err, b32 verbose)
+enum { BATCH_MAX = 1024 };  // actions submitted to the platform at once
+
+// Mark path as touched by the batch, and its ancestors as containing
+// something touched. Returns 0 if the path conflicts with the batch so far.
+static b32 batch_claim_(pathmap **claimed, s8 path, arena *scratch)
 {
-    // Track filesystem state for existence queries
-    fsstate *fs = new_fsstate(ctx, &scratch);
+    enum { CLAIM_PATH = 1, CLAIM_ANCESTOR = 2 };
+    if (pathmap_lookup(claimed, path)) {
+        return 0;  // already touched, or something below it was
+    }
+    for (iz j = 1; j < path.len; j++) {
+        if (path.s[j] == '/' || path.s[j] == '\\') {
+            iz *v = pathmap_lookup(claimed, takehead(path, j));
+            if (v && *v == CLAIM_PATH) {
+                return 0;  // inside something the batch moves or deletes
+            }
+        }
+    }
+    *pathmap_insert(claimed, path, scratch) = CLAIM_PATH;
+    for (iz j = 1; j < path.len; j++) {
+        if (path.s[j] == '/' || path.s[j] == '\\') {
+            iz *v = pathmap_insert(claimed, takehead(path, j), scratch);
+            if (*v == NOT_FOUND) {
+                *v = CLAIM_ANCESTOR;
+            }
+        }
+    }
+    return 1;
+}
+
+// Collect the run of actions order[0, n) whose paths are unrelated to
+// each other, so they may run in any order, and create the destination
+// directories they need. Stashes end a run, as do deletes whose type is
+// unknown. Returns the number of actions gathered into ops. Their paths
+// are built in perm, which the caller frees once the batch has run.
+static iz gather_batch_(fsstate *fs, arena *perm, Plan plan, iz *order, iz n, osop *ops)
+{
+    pathmap *claimed = 0;
+    iz len = 0;
+    for (; len < n && len < BATCH_MAX; len++) {
+        Action a = plan.actions[order[len]];
+        if (a.op != OP_RENAME && (a.op != OP_DELETE || a.type == FT_UNKNOWN)) {
+            break;
+        }
+        s8 src = pathtab_get(plan.paths, a.src, perm);
+        s8 dst = pathtab_get(plan.paths, a.dst, perm);
+        if (!batch_claim_(&claimed, src, perm) ||
+            (a.op == OP_RENAME && !batch_claim_(&claimed, dst, perm))) {
+            break;
+        }
+        ops[len] = (osop){src, dst, a.type, 0};
+    }
+
+    for (iz i = 0; i < len; i++) {
+        Action a = plan.actions[order[i]];
+        if (a.op == OP_RENAME && !fsstate_ensure_dir(fs, a.dst, perm)) {
+            return i;  // a failed mkdir is reported when run on its own
+        }
+    }
+    return len;
+}
+
+static iz unit_find_(iz *parent, iz u)
+{
+    while (parent[u] != u) {
+        u = parent[u] = parent[parent[u]];
+    }
+    return u;
+}
+
+// Group the plan's units into jobs that may run at the same time, writing
+// the action indices of job k to order[jobs[k], jobs[k+1]), each job in
+// plan order. Units sharing a path are merged. A unit touching a path
+// inside, or containing, another touched path must keep its place in the
+// plan: all of those make up job 0 and run serially. Stashes need no such
+// care, each having a temporary name of its own. Returns the number of jobs.
+static iz schedule_units_(Plan plan, arena *scratch, iz **porder, iz **pjobs)
+{
+    iz nunits = plan.nunits;
+    iz *parent = newnz(scratch, iz, nunits);
+    for (iz u = 0; u < nunits; u++) {
+        parent[u] = u;
+    }
+
+    // Merge units that share a path, and note every ancestor. The earliest
+    // unit stays the root of its group.
+    pathent *ents = plan.paths->ents;
+    iz *owner = newnz(scratch, iz, plan.paths->len);
+    for (iz id = 0; id < plan.paths->len; id++) {
+        owner[id] = NOT_FOUND;
+    }
+    u8 *inside = new(scratch, u8, plan.paths->len);
+    for (iz u = 0; u < nunits; u++) {
+        iz end = u+1 < nunits ? plan.units[u+1] : plan.len;
+        for (iz i = plan.units[u]; i < end; i++) {
+            pathid ids[2] = {plan.actions[i].src, plan.actions[i].dst};
+            for (i32 p = 0; p < 2; p++) {
+                if (ids[p] == NO_PATH) continue;
+                if (owner[ids[p]] == NOT_FOUND) {
+                    owner[ids[p]] = u;
+                } else {
+                    iz x = unit_find_(parent, u);
+                    iz y = unit_find_(parent, owner[ids[p]]);
+                    parent[x > y ? x : y] = x > y ? y : x;
+                }
+                pathid dir = ents[ids[p]].parent;
+                for (; dir != NO_PATH && !inside[dir]; dir = ents[dir].parent) {
+                    inside[dir] = 1;
+                }
+            }
+        }
+    }
+
+    // Find the groups that must run serially
+    b32 *serial = new(scratch, b32, nunits);
+    for (iz u = 0; u < nunits; u++) {
+        iz end = u+1 < nunits ? plan.units[u+1] : plan.len;
+        b32 keep_order = 0;
+        for (iz i = plan.units[u]; i < end && !keep_order; i++) {
+            Action a = plan.actions[i];
+            pathid ids[2] = {a.src, a.dst};
+            for (i32 p = 0; p < 2 && !keep_order; p++) {
+                if (ids[p] == NO_PATH) continue;
+                keep_order = inside[ids[p]];
+                pathid dir = ents[ids[p]].parent;
+                for (; dir != NO_PATH && !keep_order; dir = ents[dir].parent) {
+                    keep_order = owner[dir] != NOT_FOUND;
+                }
+            }
+        }
+        if (keep_order) {
+            serial[unit_find_(parent, u)] = 1;
+        }
+    }
+
+    // Number the jobs by first appearance, then lay out their actions
+    iz *jobof = newnz(scratch, iz, nunits);
+    iz njobs = 1;
+    for (iz u = 0; u < nunits; u++) {
+        iz root = unit_find_(parent, u);
+        if (serial[root]) {
+            jobof[u] = 0;
+        } else {
+            jobof[u] = root == u ? njobs++ : jobof[root];
+        }
+    }
+    iz *jobs = new(scratch, iz, njobs+1);
+    for (iz u = 0; u < nunits; u++) {
+        iz end = u+1 < nunits ? plan.units[u+1] : plan.len;
+        jobs[jobof[u]+1] += end - plan.units[u];
+    }
+    for (iz k = 0; k < njobs; k++) {
+        jobs[k+1] += jobs[k];
+    }
+    iz *fill = newnz(scratch, iz, njobs);
+    for (iz k = 0; k < njobs; k++) {
+        fill[k] = jobs[k];
+    }
+    iz *order = newnz(scratch, iz, plan.len);
+    for (iz u = 0; u < nunits; u++) {
+        iz end = u+1 < nunits ? plan.units[u+1] : plan.len;
+        for (iz i = plan.units[u]; i < end; i++) {
+            order[fill[jobof[u]]++] = i;
+        }
+    }
+
+    *porder = order;
+    *pjobs = jobs;
+    return njobs;
+}
+
+// Outcome of each action, reported in plan order once everything has run
+enum {
+    RUN_PENDING,   // not run, since an earlier action failed
+    RUN_DONE,
+    RUN_NO_DIR,    // destination directory could not be created
+    RUN_FAILED,
+    RUN_NO_STASH,  // unstash without a prior stash
+    RUN_NO_JOURNAL,  // its window of the journal could not be synced
+};
 
-    // Reserve all destination paths first to avoid temp name collisions
+typedef struct {
+    Plan     plan;
+    execopts opts;
+    os      *ctx;
+    iz      *order;      // action indices grouped by job
+    iz      *jobs;       // job k runs order[jobs[k], jobs[k+1])
+    iz       njobs;
+    iz       step;       // jobs claimed at once
+    u8      *status;     // RUN_* per action
+    u8      *state;      // PATH_* per path id, for every worker's fsstate
+    u32     *dirs;       // known directories, likewise
+    u32      dir_epoch;
+    arena   *arenas;     // one per worker
+    s8      *temps;      // by action, temporary name of each stash and unstash
+    u8      *logged;     // by action, listed in the journal as about to run
+    iz       next;       // next job to claim
+    b32      failed;     // set on the first failure, stopping every job
+    i64      lookups;
+    i64      hits;
+} runner;
+
+enum { JOURNAL_WINDOW = 1 << 12 };  // most actions logged with one sync
+
+// Journal names of each Op
+static const s8 journal_ops_[] = {s8("delete"), s8("rename"), s8("stash"), s8("unstash")};
+
+// Start a new journal with the whole plan, one line per path, and sync it
+// before anything runs. No path holds a newline, as the listing cannot.
+static b32 journal_plan_(Plan plan, s8 *temps, os *ctx, arena scratch)
+{
+    u8buf *b = newfdbuf(&scratch, 4, 1<<16);
+    prints8(b, S("vidir journal\n"));
+    prints8(b, S("actions "));
+    printi64(b, plan.len);
+    prints8(b, S("\n"));
+    iz u = 0;
     for (iz i = 0; i < plan.len; i++) {
+        for (; u < plan.nunits && plan.units[u] == i; u++) {
+            prints8(b, S("unit\n"));
+        }
+        Action a = plan.actions[i];
+        arena temp = scratch;
+        prints8(b, journal_ops_[a.op]);
+        prints8(b, S(" "));
+        printi64(b, a.type);
+        prints8(b, S("\n"));
+        prints8(b, a.op == OP_UNSTASH ? temps[i] : pathtab_get(plan.paths, a.src, &temp));
+        prints8(b, S("\n"));
+        prints8(b, a.op == OP_STASH ? temps[i] : pathtab_get(plan.paths, a.dst, &temp));
+        prints8(b, S("\n"));
+    }
+    flush(b);
+    return os_sync_journal(ctx);
+}
+
+// Log the window of actions about to run, from order[0, n), and sync it.
+// No two of them touch the same path, or one inside the other, so after a
+// crash each one's source alone tells whether it ran. Records go out in a
+// single write, whole, among those of other workers. Returns the number
+// of actions in the window, or 0 if it could not be synced.
+static iz journal_window_(runner *r, i32 worker, iz *order, iz n, arena scratch)
+{
+    Plan plan = r->plan;
+    u8buf *b = newfdbuf(&scratch, 4, 32 + JOURNAL_WINDOW*21);
+    prints8(b, r->opts.undo ? S("undo ") : S("run "));
+    printi64(b, worker);
+
+    pathmap *claimed = 0;
+    iz len = 0;
+    for (; len < n && len < JOURNAL_WINDOW; len++) {
+        iz i = order[len];
         Action a = plan.actions[i];
-        if ((a.op == OP_RENAME || a.op == OP_UNSTASH) && a.dst.s && a.dst.len) {
-            fsstate_mark_exists(fs, a.dst, &scratch);
+        s8 src = a.op == OP_UNSTASH ? r->temps[i] : pathtab_get(plan.paths, a.src, &scratch);
+        s8 dst = a.op == OP_STASH ? r->temps[i] : pathtab_get(plan.paths, a.dst, &scratch);
+        b32 unrelated = batch_claim_(&claimed, src, &scratch) &&
+            (!dst.s || batch_claim_(&claimed, dst, &scratch));
+        if (!unrelated && len) {
+            break;
         }
+        prints8(b, S(" "));
+        printi64(b, r->opts.ids ? r->opts.ids[i] : i);
+        r->logged[i] = 1;
     }
+    prints8(b, S("\n"));
+    flush(b);
+    return os_sync_journal(r->ctx) ? len : 0;
+}
 
-    s8 temp_name = {0};  // Will be generated on first STASH operation
+// Close the journal's windows: those of their actions that did not run
+// are listed, and the rest are then known to have run
+static b32 journal_end_(runner *r, arena scratch)
+{
+    u8buf *b = newfdbuf(&scratch, 4, 1<<16);
+    b32 any = 0;
+    for (iz i = 0; i < r->plan.len; i++) {
+        if (r->logged[i] && r->status[i] != RUN_DONE) {
+            prints8(b, any ? S(" ") : S("skip "));
+            printi64(b, r->opts.ids ? r->opts.ids[i] : i);
+            any = 1;
+        }
+    }
+    prints8(b, any ? S("\nend\n") : S("end\n"));
+    flush(b);
+    return os_sync_journal(r->ctx);
+}
 
-    // Execute each action
-    for (iz i = 0; i < plan.len; i++) {
+// Run jobs [beg, end) one after another
+static void run_jobs_(runner *r, i32 worker, iz beg, iz end, fsstate *fs, arena *scratch, osop *batch)
+{
+    Plan plan = r->plan;
+    os *ctx = r->ctx;
+    iz *order = r->order + r->jobs[beg];
+    iz len = r->jobs[end] - r->jobs[beg];
+
+    // Runs of independent actions go to the platform together. Their
+    // results are then checked as if each had run on its own.
+    b32 batching = batch != 0;
+    iz batch_beg = 0;
+    iz batch_end = 0;  // actions up to here already ran as a batch
+    arena batchmem = *scratch;  // holds the batch's paths
+
+    // A journal logs each window of actions before they run, and batches
+    // stay inside one window
+    iz window_end = r->opts.journal ? 0 : len;
+
+    for (iz k = 0; k < len; k++) {
+        if (__atomic_load_n(&r->failed, __ATOMIC_RELAXED)) {
+            return;
+        }
+        if (k >= window_end) {
+            iz n = journal_window_(r, worker, order+k, len-k, *scratch);
+            if (!n) {
+                r->status[order[k]] = RUN_NO_JOURNAL;
+                __atomic_store_n(&r->failed, 1, __ATOMIC_RELAXED);
+                return;
+            }
+            window_end = k + n;
+        }
+        if (batching && k >= batch_end) {
+            batchmem = *scratch;
+            iz n = gather_batch_(fs, &batchmem, plan, order+k, window_end-k, batch);
+            batch_beg = batch_end = k;
+            if (n > 1) {
+                batching = os_run_batch(ctx, batchmem, batch, n);
+                batch_end = batching ? k + n : k;
+            }
+        }
+        b32 batched = k < batch_end;
+
+        // Paths are built for each action past the batch's, and dropped
+        iz i = order[k];
         Action a = plan.actions[i];
+        arena temp = batchmem;
+        s8 src = batched ? batch[k-batch_beg].src : pathtab_get(plan.paths, a.src, &temp);
+        s8 dst = batched ? batch[k-batch_beg].dst : pathtab_get(plan.paths, a.dst, &temp);
+        u8 status = RUN_DONE;
         switch (a.op) {
         case OP_STASH: {
-            // Generate temporary name on first use
-            if (!temp_name.s) {
-                temp_name = fsstate_unique_name(fs, S(".vidir_temp"), &scratch);
-            }
-            
             // Move file to temporary location
-            if (!os_rename_file(ctx, scratch, a.src, temp_name)) {
-                prints8(err, S("vidir: failed to stash: "));
-                prints8(err, a.src);
-                prints8(err, S(" -> "));
-                prints8(err, temp_name);
-                prints8(err, S("\n"));
-                flush(err);
-                return 0;
-            }
-            
-            fsstate_mark_deleted(fs, a.src, &scratch);
-            fsstate_mark_exists(fs, temp_name, &scratch);
-            
-            if (verbose) {
-                prints8(out, S("stash "));
-                prints8(out, a.src);
-                prints8(out, S(" -> "));
-                prints8(out, temp_name);
-                prints8(out, S("\n"));
+            if (!os_rename_file(ctx, temp, src, r->temps[i], a.type)) {
+                status = RUN_FAILED;
+                break;
             }
+            fsstate_mark_deleted(fs, a.src);
         } break;
         case OP_RENAME: {
             // Ensure destination directory exists
-            s8 dir = dirname_s8(a.dst);
-            if (!os_create_dir(ctx, scratch, dir)) {
-                prints8(err, S("vidir: failed to create directory for: "));
-                prints8(err, a.dst);
-                prints8(err, S("\n"));
-                flush(err);
-                return 0;
+            if (!batched && !fsstate_ensure_dir(fs, a.dst, &temp)) {
+                status = RUN_NO_DIR;
+                break;
             }
 
             // Try rename directly
-            if (!os_rename_file(ctx, scratch, a.src, a.dst)) {
-                prints8(err, S("vidir: failed to rename: "));
-                prints8(err, a.src);
-                prints8(err, S(" -> "));
-                prints8(err, a.dst);
-                prints8(err, S("\n"));
-                flush(err);
-                return 0;
-            }
-            fsstate_mark_deleted(fs, a.src, &scratch);
-            fsstate_mark_exists(fs, a.dst, &scratch);
-            if (verbose) {
-                prints8(out, S("rename "));
-                prints8(out, a.src);
-                prints8(out, S(" -> "));
-                prints8(out, a.dst);
-                prints8(out, S("\n"));
+            b32 renamed = batched
+                ? batch[k-batch_beg].ok
+                : os_rename_file(ctx, temp, src, dst, a.type);
+            if (!renamed) {
+                status = RUN_FAILED;
+                break;
             }
+            fsstate_mark_deleted(fs, a.src);
+            fsstate_mark_exists(fs, a.dst);
         } break;
         case OP_UNSTASH: {
             // Move from temporary location to final destination
-            // temp_name should have been set by a previous STASH operation
-            if (!temp_name.s) {
-                prints8(err, S("vidir: unstash without prior stash\n"));
-                flush(err);
-                return 0;
+            // Its name should have been set by a previous STASH operation
+            if (!r->temps || !r->temps[i].s) {
+                status = RUN_NO_STASH;
+                break;
             }
 
             // Ensure destination directory exists
-            s8 dir = dirname_s8(a.dst);
-            if (!os_create_dir(ctx, scratch, dir)) {
-                prints8(err, S("vidir: failed to create directory for: "));
-                prints8(err, a.dst);
-                prints8(err, S("\n"));
-                flush(err);
-                return 0;
+            if (!fsstate_ensure_dir(fs, a.dst, &temp)) {
+                status = RUN_NO_DIR;
+                break;
             }
-
-            if (!os_rename_file(ctx, scratch, temp_name, a.dst)) {
-                prints8(err, S("vidir: failed to unstash: "));
-                prints8(err, temp_name);
-                prints8(err, S(" -> "));
-                prints8(err, a.dst);
-                prints8(err, S("\n"));
-                flush(err);
-                return 0;
-            }
-            
-            fsstate_mark_deleted(fs, temp_name, &scratch);
-            fsstate_mark_exists(fs, a.dst, &scratch);
-            
-            if (verbose) {
-                prints8(out, S("unstash "));
-                prints8(out, temp_name);
-                prints8(out, S(" -> "));
-                prints8(out, a.dst);
-                prints8(out, S("\n"));
+            if (!os_rename_file(ctx, temp, r->temps[i], dst, a.type)) {
+                status = RUN_FAILED;
+                break;
             }
+            fsstate_mark_exists(fs, a.dst);
         } break;
         case OP_DELETE: {
-            if (!os_delete_path(ctx, scratch, a.src)) {
-                // If already gone, ignore; else report
-                if (fsstate_exists(fs, a.src, &scratch)) {
-                    prints8(err, S("vidir: failed to delete: "));
-                    prints8(err, a.src);
-                    prints8(err, S("\n"));
-                    flush(err);
-                    return 0;
+            b32 deleted = batched
+                ? batch[k-batch_beg].ok
+                : os_delete_path(ctx, temp, src, a.type);
+            if (!deleted) {
+                // If already gone, ignore; else report. Its listed type
+                // says nothing about that, so ask the OS.
+                if (os_path_exists(ctx, temp, src)) {
+                    status = RUN_FAILED;
                 }
             } else {
-                fsstate_mark_deleted(fs, a.src, &scratch);
-            }
-            if (verbose) {
-                prints8(out, S("delete "));
-                prints8(out, a.src);
-                prints8(out, S("\n"));
+                fsstate_mark_deleted(fs, a.src);
             }
         } break;
         }
+
+        if (status == RUN_DONE && a.type != FT_FILE && a.type != FT_OTHER) {
+            fsstate_forget_dirs(fs);  // it may have been a directory
+        }
+        r->status[i] = status;
+        if (status != RUN_DONE) {
+            __atomic_store_n(&r->failed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+}
+
+static void run_worker_(void *arg, i32 id)
+{
+    runner *r = arg;
+    arena *scratch = r->arenas + id;
+
+    // Track filesystem state for existence queries
+    fsstate *fs = new_fsstate(r->ctx, r->plan.paths, r->state, r->dirs, &r->dir_epoch, scratch);
+    osop *batch = r->opts.batch ? newnz(scratch, osop, BATCH_MAX) : 0;
+
+    for (;;) {
+        iz job = __atomic_fetch_add(&r->next, r->step, __ATOMIC_RELAXED);
+        if (job >= r->njobs) break;
+        iz end = r->njobs - job < r->step ? r->njobs : job + r->step;
+        run_jobs_(r, id, job, end, fs, scratch, batch);
+    }
+    __atomic_add_fetch(&r->lookups, fs->lookups, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&r->hits, fs->hits, __ATOMIC_RELAXED);
+}
+
+// Report an action's outcome as if it had just run, returning 0 on failure
+static b32 report_action_(Plan plan, Action a, u8 status, s8 temp_name, u8buf *out, u8buf *err, b32 verbose, arena scratch)
+{
+    if (status == RUN_PENDING || (status == RUN_DONE && !verbose)) {
+        return 1;
+    }
+    s8 src = pathtab_get(plan.paths, a.src, &scratch);
+    s8 dst = pathtab_get(plan.paths, a.dst, &scratch);
+    switch (status) {
+    case RUN_DONE:
+        switch (a.op) {
+        case OP_STASH:
+            prints8(out, S("stash "));
+            prints8(out, src);
+            prints8(out, S(" -> "));
+            prints8(out, temp_name);
+            break;
+        case OP_RENAME:
+            prints8(out, S("rename "));
+            prints8(out, src);
+            prints8(out, S(" -> "));
+            prints8(out, dst);
+            break;
+        case OP_UNSTASH:
+            prints8(out, S("unstash "));
+            prints8(out, temp_name);
+            prints8(out, S(" -> "));
+            prints8(out, dst);
+            break;
+        case OP_DELETE:
+            prints8(out, S("delete "));
+            prints8(out, src);
+            break;
+        }
+        prints8(out, S("\n"));
+        return 1;
+    case RUN_NO_DIR:
+        prints8(err, S("vidir: failed to create directory for: "));
+        prints8(err, dst);
+        break;
+    case RUN_NO_STASH:
+        prints8(err, S("vidir: unstash without prior stash"));
+        break;
+    case RUN_NO_JOURNAL:
+        prints8(err, S("vidir: failed to write journal"));
+        break;
+    case RUN_FAILED:
+        switch (a.op) {
+        case OP_STASH:
+            prints8(err, S("vidir: failed to stash: "));
+            prints8(err, src);
+            prints8(err, S(" -> "));
+            prints8(err, temp_name);
+            break;
+        case OP_RENAME:
+            prints8(err, S("vidir: failed to rename: "));
+            prints8(err, src);
+            prints8(err, S(" -> "));
+            prints8(err, dst);
+            break;
+        case OP_UNSTASH:
+            prints8(err, S("vidir: failed to unstash: "));
+            prints8(err, temp_name);
+            prints8(err, S(" -> "));
+            prints8(err, dst);
+            break;
+        case OP_DELETE:
+            prints8(err, S("vidir: failed to delete: "));
+            prints8(err, src);
+            break;
+        }
+        break;
+    }
+    prints8(err, S("\n"));
+    flush(err);
+    return 0;
+}
+
+// Name a temporary for each stash, in the directory it stashes from, so
+// that it is a rename within one directory, and no two cycles share one.
+// A unit unstashes the name it last stashed to. Names are numbered per
+// directory and kept clear of the plan's destinations and existing files.
+static s8 *stash_names_(Plan plan, fsstate *fs, arena *perm)
+{
+    s8 *r = new(perm, s8, plan.len);
+    u32 *counts = new(perm, u32, plan.paths->len + 1);  // last for the top
+    s8 base = S(".vidir_temp");
+    s8 last = {0};
+    for (iz i = 0; i < plan.len; i++) {
+        Action a = plan.actions[i];
+        if (a.op == OP_UNSTASH) {
+            r[i] = last;
+            continue;
+        } else if (a.op != OP_STASH) {
+            continue;
+        }
+
+        pathent *e = plan.paths->ents + a.src;
+        iz slot = e->parent == NO_PATH ? plan.paths->len : e->parent;
+        u32 n = counts[slot]++;
+        s8 dir = e->parent == NO_PATH ? S("") : pathtab_get(plan.paths, e->parent, perm);
+        u8buf *b = newfdbuf(perm, 0, dir.len + 1 + base.len + 10);  // never flushed
+        if (e->parent != NO_PATH) {
+            prints8(b, dir);
+            prints8(b, (s8){&e->sep, 1});
+        }
+        prints8(b, base);
+        if (n) {
+            printi64(b, n);
+        }
+        last = r[i] = fsstate_unique_name(fs, gets8(b), perm);
+    }
+    return r;
+}
+
+static b32 execute_plan(Plan plan, arena scratch, os *ctx, u8buf *out, u8buf *err, execopts opts, stats *st)
+{
+    byte *scratch_start = scratch.beg;
+    runner r = {0};
+    r.plan = plan;
+    r.opts = opts;
+    r.ctx = ctx;
+    r.status = new(&scratch, u8, plan.len);
+    r.state = new(&scratch, u8, plan.paths->len);
+    r.dirs = new(&scratch, u32, plan.paths->len);
+    r.dir_epoch = 1;
+
+    // Reserve all destination paths first to avoid temp name collisions.
+    // A fresh plan's sources were just listed, and those of known type
+    // exist without asking again; a journal's may have moved since.
+    fsstate *fs = new_fsstate(ctx, plan.paths, r.state, r.dirs, &r.dir_epoch, &scratch);
+    b32 listed = !opts.skip && !opts.undo;
+    for (iz i = 0; i < plan.len; i++) {
+        Action a = plan.actions[i];
+        if (listed && a.src != NO_PATH && a.type != FT_UNKNOWN) {
+            fsstate_mark_exists(fs, a.src);
+        }
+        if ((a.op == OP_RENAME || a.op == OP_UNSTASH) && a.dst != NO_PATH) {
+            fsstate_mark_exists(fs, a.dst);
+        }
+    }
+    if (opts.temps) {
+        r.temps = opts.temps;
+    } else if (plan.cycles) {
+        r.temps = stash_names_(plan, fs, &scratch);
+    }
+
+    // A new journal holds the whole plan before any of it runs
+    if (opts.journal) {
+        r.logged = new(&scratch, u8, plan.len);
+    }
+    if (opts.journal == JOURNAL_NEW && !journal_plan_(plan, r.temps, ctx, scratch)) {
+        prints8(err, S("vidir: failed to write journal\n"));
+        flush(err);
+        return 0;
+    }
+
+    // Independent units run as separate jobs on a pool of workers. With a
+    // single worker everything is one job, run in plan order.
+    if (opts.jobs > 1 && plan.nunits > 1) {
+        r.njobs = schedule_units_(plan, &scratch, &r.order, &r.jobs);
+    } else {
+        r.njobs = 1;
+        r.order = newnz(&scratch, iz, plan.len);
+        for (iz i = 0; i < plan.len; i++) {
+            r.order[i] = i;
+        }
+        r.jobs = newnz(&scratch, iz, 2);
+        r.jobs[0] = 0;
+        r.jobs[1] = plan.len;
+    }
+
+    // Actions an earlier run carried out are left out of every job
+    if (opts.skip) {
+        iz n = 0;
+        for (iz k = 0; k < r.njobs; k++) {
+            iz beg = r.jobs[k];
+            r.jobs[k] = n;
+            for (iz j = beg; j < r.jobs[k+1]; j++) {
+                if (!opts.skip[r.order[j]]) {
+                    r.order[n++] = r.order[j];
+                }
+            }
+        }
+        r.jobs[r.njobs] = n;
+    }
+
+    i32 nworkers = opts.jobs < 1 ? 1 : opts.jobs;
+    nworkers = nworkers > r.njobs ? (i32)r.njobs : nworkers;
+
+    // With a journal, workers take runs of small jobs, so that one window
+    // of the journal can cover many
+    r.step = 1;
+    if (opts.journal && r.njobs/(8*(iz)nworkers) > 1) {
+        r.step = r.njobs / (8*(iz)nworkers);
+    }
+    arena *arenas = newnz(&scratch, arena, nworkers);
+    byte **starts = newnz(&scratch, byte *, nworkers);
+    nworkers = arena_split(&scratch, arenas, nworkers);
+    for (i32 i = 0; i < nworkers; i++) {
+        starts[i] = arenas[i].beg;
+    }
+    r.arenas = arenas;
+
+    os_parallel(ctx, nworkers, run_worker_, &r);
+
+    b32 ok = 1;
+    if (opts.journal && !journal_end_(&r, arenas[0])) {
+        prints8(err, S("vidir: failed to write journal\n"));
+        flush(err);
+        ok = 0;
+    }
+    for (iz i = 0; i < plan.len; i++) {
+        s8 temp_name = r.temps ? r.temps[i] : (s8){0};
+        ok &= report_action_(plan, plan.actions[i], r.status[i], temp_name, out, err, opts.verbose, arenas[0]);
+    }
+
+    iz used = starts[0] - scratch_start;
+    for (i32 i = 0; i < nworkers; i++) {
+        used += arenas[i].beg - starts[i];
+    }
+    st->bytes[PHASE_EXECUTE] = used;
+    st->fs_lookups = r.lookups + fs->lookups;
+    st->fs_hits = r.hits + fs->hits;
+    return ok;
+}
+
+// A journal read back for --resume and --rollback
+typedef struct {
+    Plan plan;     // as it was journaled, naming paths in the journal text
+    s8  *temps;    // by action, temporary name of each stash and unstash
+    u8  *applied;  // by action, carried out and not since undone
+    b32  ok;       // it could be read and settled
+    b32  cut;      // it ends before the whole plan, so nothing ran
+} journaled;
+
+// Cut the next complete line from text. A torn record, cut off by a
+// crash, was never synced and so never acted on.
+static b32 journal_line_(s8 *text, s8 *line)
+{
+    iz end = s8index(*text, '\n');
+    if (end == text->len) {
+        return 0;
+    }
+    *line = takehead(*text, end);
+    *text = cuthead(*text, end+1);
+    return 1;
+}
+
+// Cut the next space-separated field from line
+static s8 journal_field_(s8 *line)
+{
+    iz end = s8index(*line, ' ');
+    s8 r = takehead(*line, end);
+    *line = cuthead(*line, end < line->len ? end+1 : end);
+    return r;
+}
+
+enum { WINDOW_RUN = 1, WINDOW_UNDO = 2 };
+
+// Mark the actions of a window record pending, or settle them as having
+// happened, as far as no later record said otherwise
+static b32 journal_indices_(s8 rec, journaled *j, u8 *pending, i32 kind, b32 settle)
+{
+    journal_field_(&rec);  // run or undo
+    journal_field_(&rec);  // worker
+    while (rec.len) {
+        i32 i;
+        if (!s8toi32(journal_field_(&rec), &i) || i >= j->plan.len) {
+            return 0;
+        }
+        if (!settle) {
+            pending[i] = (u8)kind;
+        } else if (pending[i] == kind) {
+            j->applied[i] = kind == WINDOW_RUN;
+            pending[i] = 0;
+        }
+    }
+    return 1;
+}
+
+// Read a journal back and settle it. A window a crash left open is
+// resolved by whether each of its actions' sources is still there, since
+// nothing else in the window touched it, and the outcome is appended to
+// the journal, open as fd 4, so that it never needs guessing again.
+static journaled read_journal(arena *perm, os *ctx, s8 text)
+{
+    journaled j = {0};
+    j.cut = 1;
+    s8 line;
+    if (!journal_line_(&text, &line)) {
+        return j;
+    } else if (!s8equals(line, S("vidir journal"))) {
+        j.cut = 0;
+        return j;
+    } else if (!journal_line_(&text, &line)) {
+        return j;
+    }
+    i32 len;
+    j.cut = 0;
+    if (!startswith(line, S("actions ")) || !s8toi32(cuthead(line, 8), &len)) {
+        return j;
+    }
+
+    j.plan.paths = new_pathtab(perm);
+    j.temps = new(perm, s8, len);
+    while (j.plan.len < len) {
+        if (!journal_line_(&text, &line)) {
+            j.cut = 1;
+            return j;
+        } else if (s8equals(line, S("unit"))) {
+            plan_begin_unit(perm, &j.plan);
+            continue;
+        }
+        s8 name = journal_field_(&line);
+        i32 op = 0;
+        for (; op < countof(journal_ops_) && !s8equals(name, journal_ops_[op]); op++) {}
+        i32 type;
+        s8 src, dst;
+        if (op == countof(journal_ops_) || !s8toi32(line, &type)) {
+            return j;
+        } else if (!journal_line_(&text, &src) || !journal_line_(&text, &dst)) {
+            j.cut = 1;
+            return j;
+        }
+        if (op == OP_UNSTASH) {
+            j.temps[j.plan.len] = src;
+            src = (s8){0};
+        } else if (op == OP_STASH) {
+            j.temps[j.plan.len] = dst;
+            dst = (s8){0};
+        }
+        pathid srcid = src.len ? pathtab_intern(j.plan.paths, src, perm, 0) : NO_PATH;
+        pathid dstid = dst.len ? pathtab_intern(j.plan.paths, dst, perm, 0) : NO_PATH;
+        plan_append(perm, &j.plan, (Op)op, srcid, dstid, type);
+        j.plan.cycles += op == OP_STASH;
     }
 
+    // Each worker's latest window stays open until its next one, since a
+    // worker only moves on once the whole window has run
+    j.applied = new(perm, u8, len);
+    u8 *pending = new(perm, u8, len);
+    s8 *open = 0;
+    iz nopen = 0;
+    iz opencap = 0;
+    while (journal_line_(&text, &line)) {
+        s8 rec = line;
+        s8 kw = journal_field_(&rec);
+        i32 kind = s8equals(kw, S("run")) ? WINDOW_RUN : s8equals(kw, S("undo")) ? WINDOW_UNDO : 0;
+        if (kind) {
+            s8 worker = journal_field_(&rec);
+            iz w = 0;
+            for (; w < nopen; w++) {
+                s8 prev = open[w];
+                i32 prevkind = startswith(prev, S("run ")) ? WINDOW_RUN : WINDOW_UNDO;
+                journal_field_(&prev);
+                if (s8equals(journal_field_(&prev), worker)) {
+                    if (!journal_indices_(open[w], &j, pending, prevkind, 1)) {
+                        return j;
+                    }
+                    break;
+                }
+            }
+            if (w == nopen) {
+                if (nopen == opencap) {
+                    open = push_(perm, open, &opencap, sizeof(s8), _Alignof(s8));
+                }
+                nopen++;
+            }
+            open[w] = line;
+            if (!journal_indices_(line, &j, pending, kind, 0)) {
+                return j;
+            }
+        } else if (s8equals(kw, S("skip"))) {
+            while (rec.len) {
+                i32 i;
+                if (!s8toi32(journal_field_(&rec), &i) || i >= len) {
+                    return j;
+                }
+                pending[i] = 0;
+            }
+        } else if (s8equals(kw, S("end")) && !rec.len) {
+            for (iz w = 0; w < nopen; w++) {
+                i32 prevkind = startswith(open[w], S("run ")) ? WINDOW_RUN : WINDOW_UNDO;
+                journal_indices_(open[w], &j, pending, prevkind, 1);
+            }
+            nopen = 0;
+        } else {
+            return j;
+        }
+    }
+
+    // Left open by a crash: ask whether each source is still there
+    if (nopen) {
+        u8buf *b = newfdbuf(perm, 4, 1<<16);
+        b32 any = 0;
+        for (iz i = 0; i < len; i++) {
+            if (!pending[i]) {
+                continue;
+            }
+            Action a = j.plan.actions[i];
+            arena scratch = *perm;
+            s8 src = pending[i] == WINDOW_RUN
+                ? (a.op == OP_UNSTASH ? j.temps[i] : pathtab_get(j.plan.paths, a.src, &scratch))
+                : (a.op == OP_STASH ? j.temps[i] : pathtab_get(j.plan.paths, a.dst, &scratch));
+            if (!os_path_exists(ctx, scratch, src)) {
+                j.applied[i] = pending[i] == WINDOW_RUN;
+            } else {
+                prints8(b, any ? S(" ") : S("skip "));
+                printi64(b, i);
+                any = 1;
+            }
+        }
+        prints8(b, any ? S("\nend\n") : S("end\n"));
+        flush(b);
+        if (!os_sync_journal(ctx)) {
+            return j;
+        }
+    }
+    j.ok = 1;
+    return j;
+}
+
+// The plan putting back what the journal's applied actions did, newest
+// first, as one serial unit. ids receives the journal index of each, and
+// temps the temporary name each stash and unstash reuses. Deletes cannot
+// be put back and are left out.
+static Plan invert_plan(arena *perm, journaled *j, iz **ids, s8 **temps)
+{
+    Plan r = {0};
+    r.paths = j->plan.paths;
+    iz n = 0;
+    for (iz i = 0; i < j->plan.len; i++) {
+        n += j->applied[i] && j->plan.actions[i].op != OP_DELETE;
+    }
+    *ids = newnz(perm, iz, n);
+    *temps = new(perm, s8, n);
+    if (n) {
+        plan_begin_unit(perm, &r);
+    }
+    for (iz i = j->plan.len-1; i >= 0; i--) {
+        Action a = j->plan.actions[i];
+        if (!j->applied[i] || a.op == OP_DELETE) {
+            continue;
+        }
+        (*ids)[r.len] = i;
+        (*temps)[r.len] = j->temps[i];
+        switch (a.op) {
+        case OP_RENAME:
+            plan_append(perm, &r, OP_RENAME, a.dst, a.src, a.type);
+            break;
+        case OP_STASH:
+            plan_append(perm, &r, OP_UNSTASH, NO_PATH, a.src, a.type);
+            break;
+        case OP_UNSTASH:
+            plan_append(perm, &r, OP_STASH, a.dst, NO_PATH, a.type);
+            r.cycles++;
+            break;
+        case OP_DELETE:
+            break;
+        }
+    }
+    return r;
+}
+
+// Parse n <= 8 decimal digits as one word: check every byte at once, then
+// combine pairs, then pairs of pairs, with a multiply each
+static b32 parse_digits8_(u8 *s, iz n, i32 *r)
+{
+    u64 ones = 0x0101010101010101u;
+    u64 pad = n < 8 ? ones*'0' >> 8*n : 0;
+    u64 w = (n ? loadtail_(s, n) << 8*(8-n) : 0) | pad;  // leading zeros
+    u64 hi = 0xf0f0f0f0f0f0f0f0u;
+    if (((w & hi) | ((w + ones*6) & hi) >> 4) != ones*0x33) {
+        return 0;  // not all digits
+    }
+    w = (w & 0x0f0f0f0f0f0f0f0fu) * 2561 >> 8;
+    w = (w & 0x00ff00ff00ff00ffu) * 6553601 >> 16;
+    *r = (i32)((w & 0x0000ffff0000ffffu) * 42949672960001u >> 32);
     return 1;
 }
 
@@ -1006,33 +3213,33 @@ static b32 execute_plan(Plan plan, arena scratch, os *ctx, u8buf *out, u8buf *er
 static b32 parse_temp_line(s8 *line, i32 *line_number)
 {
     // Scan for tab
-    iz tab_pos = -1;
-    for (iz i = 0; i < line->len; i++) {
-        if (line->s[i] == '\t') {
-            tab_pos = i;
-            break;
-        }
-    }
+    iz tab_pos = s8index(*line, '\t');
     
-    if (tab_pos == -1) {
+    if (tab_pos == line->len) {
         // No tab found - invalid line
         return 0;
     }
     
     // Parse number part
     i32 num = 0;
-    for (iz i = 0; i < tab_pos; i++) {
-        if (line->s[i] >= '0' && line->s[i] <= '9') {
-            i32 digit = line->s[i] - '0';
-            if (num > (0x7fffffff - digit) / 10) {
-                // Would overflow
+    if (tab_pos <= 8) {
+        if (!parse_digits8_(line->s, tab_pos, &num)) {
+            return 0;
+        }
+    } else {
+        for (iz i = 0; i < tab_pos; i++) {
+            if (line->s[i] >= '0' && line->s[i] <= '9') {
+                i32 digit = line->s[i] - '0';
+                if (num > (0x7fffffff - digit) / 10) {
+                    // Would overflow
+                    return 0;
+                }
+            
+                num = num * 10 + digit;
+            } else {
+                // Invalid character in number
                 return 0;
             }
-            
-            num = num * 10 + digit;
-        } else {
-            // Invalid character in number
-            return 0;
         }
     }
     
@@ -1052,195 +3259,705 @@ static b32 parse_temp_line(s8 *line, i32 *line_number)
     return 1;
 }
 
+// Print a nanosecond count as milliseconds with three decimals
+static void printms(u8buf *b, i64 ns)
+{
+    i64 us = ns / 1000;
+    printi64(b, us / 1000);
+    prints8(b, S("."));
+    u8 frac[3] = {
+        (u8)('0' + us/100%10), (u8)('0' + us/10%10), (u8)('0' + us%10)
+    };
+    prints8(b, (s8){frac, 3});
+}
+
+// Pad output to a column by writing spaces
+static void printpad(u8buf *b, iz width, iz used)
+{
+    for (; used < width; used++) {
+        prints8(b, S(" "));
+    }
+}
+
+static iz i64len(i64 x)
+{
+    iz len = x < 0;
+    do {
+        len++;
+    } while (x /= 10);
+    return len;
+}
+
+static void print_stats(u8buf *b, stats *st, Plan plan, oscounters *calls, iz files)
+{
+    prints8(b, S("vidir: stats for "));
+    printi64(b, files);
+    prints8(b, S(" files\n"));
+    prints8(b, S("  phase            ms         bytes\n"));
+    i64 total = 0;
+    for (i32 p = 0; p < PHASE_COUNT; p++) {
+        prints8(b, S("  "));
+        prints8(b, phase_names[p]);
+        printpad(b, 10, phase_names[p].len);
+        printpad(b, 10, i64len(st->ns[p] / 1000000) + 4);
+        printms(b, st->ns[p]);
+        printpad(b, 14, i64len(st->bytes[p]));
+        printi64(b, st->bytes[p]);
+        prints8(b, S("\n"));
+        if (p != PHASE_EDITOR) total += st->ns[p];
+    }
+    prints8(b, S("  total"));
+    printpad(b, 15, i64len(total / 1000000) + 4);
+    printms(b, total);
+    prints8(b, S(" (excluding editor)\n"));
+
+    prints8(b, S("  arena: "));
+    printi64(b, st->peak);
+    prints8(b, S(" bytes peak, "));
+    printi64(b, files ? st->peak / files : 0);
+    prints8(b, S(" bytes per file\n"));
+
+    prints8(b, S("  calls: stat "));
+    printi64(b, calls->stat);
+    prints8(b, S(", rename "));
+    printi64(b, calls->rename);
+    prints8(b, S(", unlink "));
+    printi64(b, calls->unlink);
+    prints8(b, S(", rmdir "));
+    printi64(b, calls->rmdir);
+    prints8(b, S(", mkdir "));
+    printi64(b, calls->mkdir);
+    prints8(b, S(", readdir "));
+    printi64(b, calls->readdir);
+    prints8(b, S("\n"));
+
+    iz renames = 0, deletes = 0, stashes = 0;
+    for (iz i = 0; i < plan.len; i++) {
+        switch (plan.actions[i].op) {
+        case OP_RENAME:  renames++; break;
+        case OP_DELETE:  deletes++; break;
+        case OP_STASH:   stashes++; break;
+        case OP_UNSTASH: break;
+        }
+    }
+    prints8(b, S("  plan: "));
+    printi64(b, renames);
+    prints8(b, S(" renames, "));
+    printi64(b, deletes);
+    prints8(b, S(" deletes, "));
+    printi64(b, stashes);
+    prints8(b, S(" stashes, longest chain "));
+    printi64(b, plan.longest_chain);
+    prints8(b, S(", "));
+    printi64(b, plan.cycles);
+    prints8(b, S(" cycles\n"));
+
+    prints8(b, S("  fsstate: "));
+    printi64(b, st->fs_lookups);
+    prints8(b, S(" lookups, "));
+    printi64(b, st->fs_hits);
+    prints8(b, S(" hits ("));
+    printi64(b, st->fs_lookups ? st->fs_hits*100 / st->fs_lookups : 0);
+    prints8(b, S("%)\n"));
+}
+
+// Expand a directory into its sorted entries, down to maxdepth levels (0
+// for no limit), and append them to the list
+static s8node **expand_dir(arena *perm, s8node **tail, i32 *count, s8 path, i32 maxdepth, stats *st)
+{
+    s8node *entries = maxdepth == 1
+        ? os_list_dir(perm->ctx, perm, path)
+        : os_walk_dir(perm->ctx, perm, path, maxdepth);
+    i64 start = os_clock(perm->ctx);
+    entries = s8sort_(entries, *perm);
+    st->ns[PHASE_SORT] += os_clock(perm->ctx) - start;
+    while (entries) {
+        *tail = entries;
+        tail = &entries->next;
+        (*count)++;
+        entries = entries->next;
+    }
+    return tail;
+}
+
+enum { STDIN_BATCH = 1 << 12 };  // paths read from stdin per batch
+
+// Read up to max paths from in, one per line, skipping blank lines and
+// trailing whitespace. The paths are copied into perm, where the line
+// buffer also grows. Returns how many were read.
+static iz read_paths_(u8input *in, arena *perm, s8 *paths, iz max)
+{
+    arena *saved = in->perm;
+    in->perm = perm;
+    iz len = 0;
+    while (len < max) {
+        s8 line = nextline(in);
+        if (line.len == 0 && line.s == 0) break;  // EOF (null pointer)
+        
+        // Trim trailing whitespace (including \r if present)
+        while (line.len > 0 && (line.s[line.len-1] == ' ' || 
+                               line.s[line.len-1] == '\t' ||
+                               line.s[line.len-1] == '\r')) {
+            line.len--;
+        }
+        
+        if (line.len == 0) continue;  // Skip empty lines
+        
+        // Make a copy of the line in permanent memory
+        u8 *line_copy = newnz(perm, u8, line.len);
+        for (iz j = 0; j < line.len; j++) {
+            line_copy[j] = line.s[j];
+        }
+        paths[len++] = (s8){line_copy, line.len};
+    }
+    in->perm = saved;
+    return len;
+}
+
+// One batch of stdin paths is classified on every thread while thread 0
+// first reads the next batch, so reading and stat calls overlap
+typedef struct {
+    u8input *input;
+    arena   *arenas;  // one per thread, the first keeping what it reads
+    s8      *paths;   // batch being classified
+    i32     *types;
+    iz       len;
+    iz       next;    // next path to classify
+    s8      *ahead;   // batch read meanwhile
+    iz       nahead;
+} stdinjob;
+
+static void stdin_worker_(void *arg, i32 id)
+{
+    stdinjob *job = arg;
+    arena *scratch = job->arenas + id;
+    if (id == 0) {
+        job->nahead = read_paths_(job->input, scratch, job->ahead, STDIN_BATCH);
+    }
+    for (;;) {
+        iz i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->len) return;
+        job->types[i] = os_path_type(scratch->ctx, *scratch, job->paths[i]);
+    }
+}
+
+// Append the paths read from in, a directory by its sorted entries, in
+// input order
+static s8node **expand_stdin(arena *perm, u8input *in, s8node **tail, i32 *count, i32 maxdepth, stats *st)
+{
+    stdinjob job = {0};
+    job.input = in;
+    job.paths = newnz(perm, s8, STDIN_BATCH);
+    job.types = newnz(perm, i32, STDIN_BATCH);
+    job.ahead = newnz(perm, s8, STDIN_BATCH);
+    job.len = read_paths_(in, perm, job.paths, STDIN_BATCH);
+
+    i32 nthreads = os_ncpu(perm->ctx);
+    job.arenas = newnz(perm, arena, nthreads);
+    while (job.len) {
+        // Only the first arena keeps anything, so the rest are given back
+        byte *limit = perm->limit;
+        job.next = 0;
+        i32 n = arena_split(perm, job.arenas, nthreads);
+        os_parallel(perm->ctx, n, stdin_worker_, &job);
+        arena_join(perm, job.arenas, n);
+        perm->limit = limit;
+
+        for (iz i = 0; i < job.len; i++) {
+            if (job.types[i] == FT_DIR) {
+                // this is a directory - expand it and sort the entries
+                tail = expand_dir(perm, tail, count, job.paths[i], maxdepth, st);
+            } else {
+                // File, append as-is
+                tail = s8list_append(perm, tail, job.paths[i], job.types[i]);
+                (*count)++;
+            }
+        }
+
+        s8 *swap = job.paths;
+        job.paths = job.ahead;
+        job.ahead = swap;
+        job.len = job.nahead;
+    }
+    return tail;
+}
+
+// Number the listed paths for the temp file, leaving out "." and "..",
+// and intern them as displayed. Entries of one listing share their
+// directory's entry, so each costs little more than its name. The text is
+// kept, so that parse_temp_file can pass over lines left as they were.
+static listing write_listing(arena *perm, pathtab *paths, s8node *head, iz count)
+{
+    listing r = {0};
+    r.ids = newnz(perm, pathid, count);
+    r.types = newnz(perm, i32, count);
+    pathtab_reserve(paths, paths->len + count, perm);
+
+    // Directory of the entry before, when it came from a listing
+    s8 *dir = 0;
+    pathid dirid = NO_PATH;
+    u8 sep = 0;
+
+    for (s8node *n = head; n; n = n->next) {
+        s8 basename = n->str;
+        for (iz j = basename.len - 1; j >= 0 && !n->dir; j--) {
+            if (basename.s[j] == '/') {
+                basename.s += j + 1;
+                basename.len -= j + 1;
+                break;
+            }
+        }
+        if (s8equals(basename, S(".")) || s8equals(basename, S(".."))) {
+            continue;
+        }
+
+        pathid id;
+        if (n->dir && n->dir == dir) {
+            id = pathtab_child(paths, dirid, sep, n->str, perm, 0);
+        } else {
+            id = pathtab_intern_display(paths, s8node_path(n, perm), perm, 0);
+            pathent e = paths->ents[id];
+            dir = n->dir && e.sep ? n->dir : 0;
+            dirid = e.parent;
+            sep = e.sep;
+        }
+        r.ids[r.len] = id;
+        r.types[r.len] = n->type;
+        r.len++;
+    }
+
+    r.nowners = paths->len;
+    r.owner = newnz(perm, u32, r.nowners);
+    for (iz id = 0; id < r.nowners; id++) {
+        r.owner[id] = (u32)-1;
+    }
+    for (iz i = 0; i < r.len; i++) {
+        r.owner[r.ids[i]] = (u32)i;
+    }
+
+    // Size the text, then fill it, copying each line's directory from the
+    // line before when they share it
+    iz size = 0;
+    pathid parent = NO_PATH;
+    iz dirlen = 0;
+    for (iz i = 0; i < r.len; i++) {
+        pathent *e = paths->ents + r.ids[i];
+        if (e->parent != parent) {
+            parent = e->parent;
+            dirlen = pathtab_len(paths, parent);
+        }
+        size += i64len(i+1) + 1 + dirlen + (e->sep != 0) + e->len + 1;
+    }
+
+    r.text.s = newnz(perm, u8, size);
+    r.lines = newnz(perm, iz, r.len+1);
+    u8 *p = r.text.s;
+    u8 *prev = 0;  // path on the line before
+    parent = NO_PATH;
+    for (iz i = 0; i < r.len; i++) {
+        pathent *e = paths->ents + r.ids[i];
+        r.lines[i] = p - r.text.s;
+        iz digits = i64len(i+1);
+        for (iz n = i+1, d = digits; d; n /= 10) {
+            p[--d] = (u8)('0' + n%10);
+        }
+        p += digits;
+        *p++ = '\t';
+
+        u8 *path = p;
+        if (prev && e->parent == parent) {
+            for (iz j = 0; j < dirlen; j++) {
+                *p++ = prev[j];
+            }
+            if (e->sep) {
+                *p++ = e->sep;
+            }
+            for (iz j = 0; j < e->len; j++) {
+                *p++ = e->name[j];
+            }
+        } else {
+            iz len = pathtab_len(paths, r.ids[i]);
+            pathtab_put_(paths, r.ids[i], p, len);
+            p += len;
+            parent = e->parent;
+            dirlen = len - e->len - (e->sep != 0);
+        }
+        prev = path;
+        *p++ = '\n';
+    }
+    r.text.len = p - r.text.s;
+    r.lines[r.len] = r.text.len;
+    return r;
+}
+
+// Written in pieces any platform takes in one call
+static void write_temp_file(os *ctx, s8 text)
+{
+    for (iz off = 0; off < text.len; off += 1<<30) {
+        iz len = text.len - off;
+        os_write(ctx, 3, (s8){text.s + off, len < 1<<30 ? len : 1<<30});
+    }
+}
+
 static void vidir(config *);
 
 static void vidir(config *conf)
 {
     arena *perm = &conf->perm;
     byte *arena_start = perm->beg;
+    hashseed ^= (u64)os_clock(perm->ctx) ^ (uz)arena_start;
     b32 verbose = 0;
+    b32 show_stats = 0;
+    b32 batch = 0;
     b32 read_from_stdin = 0;
+    stats st = {0};
     
     // Set up buffered output
     u8buf *out = newfdbuf(perm, 1, 4096);  // stdout
     u8buf *err = newfdbuf(perm, 2, 4096);  // stderr
-    u8buf *tmp = newfdbuf(perm, 3, 4096);  // temp file
-    u8input *input = newinput(perm, 3, 4096);  // reading back from temp file
     u8input *stdin_input = newinput(perm, 0, 4096); // stdin reading
     
+    i64 phase_start = os_clock(perm->ctx);
+    byte *phase_mark = perm->beg;
+
     // Use linked list to collect paths
     s8node *paths_head = 0;
     s8node **paths_tail = &paths_head;
     i32 paths_count = 0;
 
-    // Process command line arguments
-    if (conf->nargs > 0) {
-        for (i32 i = 0; i < conf->nargs; i++) {
-            s8 arg = s8fromcstr(conf->args[i]);
-            if (s8equals(arg, S("-"))) {
-                read_from_stdin = 1;
-            } else if (startswith(arg, S("--"))) {
-                arg.len-=2;
-                arg.s+=2;
-                if (s8equals(arg, S("verbose"))) {
-                    verbose = 1;
-                } else {
-                    prints8(err, S("vidir: unknown option: --"));
-                    prints8(err, arg);
+    // Options apply to every path, wherever they appear
+    i32 maxdepth = 1;
+    i32 jobs = 1;
+    s8 list_out = {0};
+    s8 apply = {0};
+    s8 journal = {0};
+    s8 resume = {0};
+    s8 rollback = {0};
+    for (i32 i = 0; i < conf->nargs; i++) {
+        s8 arg = s8fromcstr(conf->args[i]);
+        if (!startswith(arg, S("--"))) {
+            continue;
+        }
+        arg.len-=2;
+        arg.s+=2;
+        if (s8equals(arg, S("verbose"))) {
+            verbose = 1;
+        } else if (s8equals(arg, S("stats"))) {
+            show_stats = 1;
+        } else if (s8equals(arg, S("batch"))) {
+            batch = 1;
+        } else if (s8equals(arg, S("recursive"))) {
+            maxdepth = 0;
+        } else if (s8equals(arg, S("max-depth")) || startswith(arg, S("max-depth="))) {
+            s8 value = {arg.s + 10, arg.len - 10};
+            if (arg.len == 9) {
+                value = s8fromcstr(i+1 < conf->nargs ? conf->args[++i] : 0);
+            }
+            if (!s8toi32(value, &maxdepth) || maxdepth < 1) {
+                prints8(err, S("vidir: invalid --max-depth: "));
+                prints8(err, value);
+                prints8(err, S("\n"));
+                flush(err);
+                os_exit(perm->ctx, 1);
+            }
+        } else if (s8equals(arg, S("jobs")) || startswith(arg, S("jobs="))) {
+            s8 value = {arg.s + 5, arg.len - 5};
+            if (arg.len == 4) {
+                value = s8fromcstr(i+1 < conf->nargs ? conf->args[++i] : 0);
+            }
+            if (!s8toi32(value, &jobs) || jobs < 1) {
+                prints8(err, S("vidir: invalid --jobs: "));
+                prints8(err, value);
+                prints8(err, S("\n"));
+                flush(err);
+                os_exit(perm->ctx, 1);
+            }
+        } else if (s8equals(arg, S("list-out")) || startswith(arg, S("list-out="))) {
+            list_out = (s8){arg.s + 9, arg.len - 9};
+            if (arg.len == 8) {
+                list_out = i+1 < conf->nargs ? s8fromcstr(conf->args[++i]) : S("");
+            }
+        } else if (s8equals(arg, S("apply")) || startswith(arg, S("apply="))) {
+            apply = (s8){arg.s + 6, arg.len - 6};
+            if (arg.len == 5) {
+                apply = i+1 < conf->nargs ? s8fromcstr(conf->args[++i]) : S("");
+            }
+        } else if (s8equals(arg, S("journal")) || startswith(arg, S("journal="))) {
+            journal = (s8){arg.s + 8, arg.len - 8};
+            if (arg.len == 7) {
+                journal = i+1 < conf->nargs ? s8fromcstr(conf->args[++i]) : S("");
+            }
+        } else if (s8equals(arg, S("resume")) || startswith(arg, S("resume="))) {
+            resume = (s8){arg.s + 7, arg.len - 7};
+            if (arg.len == 6) {
+                resume = i+1 < conf->nargs ? s8fromcstr(conf->args[++i]) : S("");
+            }
+        } else if (s8equals(arg, S("rollback")) || startswith(arg, S("rollback="))) {
+            rollback = (s8){arg.s + 9, arg.len - 9};
+            if (arg.len == 8) {
+                rollback = i+1 < conf->nargs ? s8fromcstr(conf->args[++i]) : S("");
+            }
+        } else {
+            prints8(err, S("vidir: unknown option: --"));
+            prints8(err, arg);
+            prints8(err, S("\n"));
+            flush(err);
+            os_exit(perm->ctx, 1);
+        }
+    }
+    if ((list_out.s && !list_out.len) || (apply.s && !apply.len)) {
+        prints8(err, S("vidir: --list-out and --apply need a file name\n"));
+        flush(err);
+        os_exit(perm->ctx, 1);
+    } else if ((journal.s && !journal.len) || (resume.s && !resume.len) ||
+               (rollback.s && !rollback.len)) {
+        prints8(err, S("vidir: --journal, --resume and --rollback need a file name\n"));
+        flush(err);
+        os_exit(perm->ctx, 1);
+    } else if (!!journal.s + !!resume.s + !!rollback.s > 1) {
+        prints8(err, S("vidir: use only one of --journal, --resume and --rollback\n"));
+        flush(err);
+        os_exit(perm->ctx, 1);
+    } else if (journal.s && os_path_exists(perm->ctx, *perm, journal)) {
+        // It may be all that is left of an interrupted run
+        prints8(err, S("vidir: journal already exists: "));
+        prints8(err, journal);
+        prints8(err, S("\n"));
+        flush(err);
+        os_exit(perm->ctx, 1);
+    } else if (apply.s && !list_out.s) {
+        // Item numbers mean nothing unless the listing is still current
+        prints8(err, S("vidir: --apply needs the --list-out listing it was edited from\n"));
+        flush(err);
+        os_exit(perm->ctx, 1);
+    }
+
+    // Carry on from a journal alone, without listing or editing again
+    if (resume.s || rollback.s) {
+        os_remove_temp_file(perm->ctx);
+        s8 path = resume.s ? resume : rollback;
+        s8 text = os_read_file(perm->ctx, perm, path);
+        if (!text.s || !os_open_journal(perm->ctx, *perm, path, 0)) {
+            prints8(err, S("vidir: failed to open journal: "));
+            prints8(err, path);
+            prints8(err, S("\n"));
+            flush(err);
+            os_exit(perm->ctx, 1);
+        }
+        journaled j = read_journal(perm, perm->ctx, text);
+        if (j.cut) {
+            prints8(err, S("vidir: journal ends before its plan, so nothing ran: "));
+            prints8(err, path);
+            prints8(err, S("\n"));
+            flush(err);
+            os_exit(perm->ctx, 1);
+        } else if (!j.ok) {
+            prints8(err, S("vidir: unreadable journal: "));
+            prints8(err, path);
+            prints8(err, S("\n"));
+            flush(err);
+            os_exit(perm->ctx, 1);
+        }
+
+        execopts opts = {0};
+        opts.verbose = verbose;
+        opts.batch = batch;
+        opts.jobs = jobs;
+        opts.journal = JOURNAL_APPEND;
+        opts.temps = j.temps;
+        Plan plan = j.plan;
+        b32 success = 1;
+        if (resume.s) {
+            opts.skip = j.applied;
+        } else {
+            opts.undo = 1;
+            plan = invert_plan(perm, &j, &opts.ids, &opts.temps);
+            for (iz i = 0; i < j.plan.len; i++) {
+                if (j.applied[i] && j.plan.actions[i].op == OP_DELETE) {
+                    arena scratch = *perm;
+                    prints8(err, S("vidir: cannot restore deleted: "));
+                    prints8(err, pathtab_get(j.plan.paths, j.plan.actions[i].src, &scratch));
                     prints8(err, S("\n"));
-                    flush(err);
-                    os_exit(perm->ctx, 1);
-                }
-            } else {
-                if (os_path_is_dir(perm->ctx, *perm, arg)) {
-                    // this is a directory - expand it and sort the entries
-                    s8node *entries = os_list_dir(perm->ctx, perm, arg);
-                    entries = s8sort_(entries);
-                    while (entries) {
-                        *paths_tail = entries;
-                        paths_tail = &entries->next;
-                        paths_count++;
-                        entries = entries->next;
-                    }
-                } else {
-                    // file - path as-is
-                    paths_tail = s8list_append(perm, paths_tail, arg);
-                    paths_count++;
+                    success = 0;
                 }
             }
         }
-    }
-    
-    // No paths provided and not reading from stdin, default to .
-    if (paths_count == 0 && !read_from_stdin) {
-        s8node *entries = os_list_dir(perm->ctx, perm, S("."));
-        entries = s8sort_(entries);
-        while (entries) {
-            *paths_tail = entries;
-            paths_tail = &entries->next;
-            paths_count++;
-            entries = entries->next;
+
+        phase_start = os_clock(perm->ctx);
+        arena scratch = *perm;
+        success &= execute_plan(plan, scratch, perm->ctx, out, err, opts, &st);
+        st.ns[PHASE_EXECUTE] = os_clock(perm->ctx) - phase_start;
+        if (show_stats) {
+            st.peak = perm->beg - arena_start + st.bytes[PHASE_EXECUTE];
+            flush(out);
+            print_stats(err, &st, plan, os_counters(perm->ctx), j.plan.len);
         }
+        flush(out);
+        flush(err);
+        if (!success) {
+            os_exit(perm->ctx, 1);
+        }
+        return;
     }
 
-    // Read from stdin if requested
-    if (read_from_stdin) {
-        for (;;) {
-            s8 line = nextline(stdin_input);
-            if (line.len == 0 && line.s == 0) break;  // EOF (null pointer)
-            
-            // Trim trailing whitespace (including \r if present)
-            while (line.len > 0 && (line.s[line.len-1] == ' ' || 
-                                   line.s[line.len-1] == '\t' ||
-                                   line.s[line.len-1] == '\r')) {
-                line.len--;
-            }
-            
-            if (line.len == 0) continue;  // Skip empty lines
-            
-            // Make a copy of the line in permanent memory
-            u8 *line_copy = new(perm, u8, line.len);
-            for (iz j = 0; j < line.len; j++) {
-                line_copy[j] = line.s[j];
-            }
-            s8 path = {line_copy, line.len};
-            
-            if (os_path_is_dir(perm->ctx, *perm, path)) {
+    // Process command line paths
+    for (i32 i = 0; i < conf->nargs; i++) {
+        s8 arg = s8fromcstr(conf->args[i]);
+        if (s8equals(arg, S("--jobs")) || s8equals(arg, S("--max-depth")) ||
+                s8equals(arg, S("--list-out")) ||
+                s8equals(arg, S("--apply")) || s8equals(arg, S("--journal")) ||
+                s8equals(arg, S("--resume")) || s8equals(arg, S("--rollback"))) {
+            i++;  // its value was taken above
+        } else if (s8equals(arg, S("-"))) {
+            read_from_stdin = 1;
+        } else if (!startswith(arg, S("--"))) {
+            i32 type = os_path_type(perm->ctx, *perm, arg);
+            if (type == FT_DIR) {
                 // this is a directory - expand it and sort the entries
-                s8node *entries = os_list_dir(perm->ctx, perm, path);
-                entries = s8sort_(entries);
-                while (entries) {
-                    *paths_tail = entries;
-                    paths_tail = &entries->next;
-                    paths_count++;
-                    entries = entries->next;
-                }
+                paths_tail = expand_dir(perm, paths_tail, &paths_count, arg, maxdepth, &st);
             } else {
-                // File, append as-is
-                paths_tail = s8list_append(perm, paths_tail, path);
+                // file - path as-is
+                paths_tail = s8list_append(perm, paths_tail, arg, type);
                 paths_count++;
             }
         }
     }
+    
+    // No paths provided and not reading from stdin, default to .
+    if (paths_count == 0 && !read_from_stdin) {
+        paths_tail = expand_dir(perm, paths_tail, &paths_count, S("."), maxdepth, &st);
+    }
 
-    // Convert linked list to array for indexing
-    s8 *paths = new(perm, s8, paths_count);
-    i32 idx = 0;
-    for (s8node *n = paths_head; n; n = n->next) {
-        paths[idx++] = n->str;
+    // Read from stdin if requested
+    if (read_from_stdin) {
+        paths_tail = expand_stdin(perm, stdin_input, paths_tail, &paths_count, maxdepth, &st);
     }
 
+    i64 now = os_clock(perm->ctx);
+    st.ns[PHASE_LIST] = now - phase_start - st.ns[PHASE_SORT];
+    st.bytes[PHASE_LIST] = perm->beg - phase_mark;
+    phase_start = now;
+    phase_mark = perm->beg;
+
     // Filter out . and .. entries and write to temporary file
-    s8 *original_names = new(perm, s8, paths_count);
-    i32 original_name_count = 0;
-    
-    for (i32 i = 0; i < paths_count; i++) {
-        s8 path = paths[i];
-        s8 basename = path;
-        
-        // Find the last slash to get basename
-        for (iz j = path.len - 1; j >= 0; j--) {
-            if (path.s[j] == '/') {
-                basename.s = path.s + j + 1;
-                basename.len = path.len - j - 1;
-                break;
-            }
+    pathtab *paths = new_pathtab(perm);
+    listing orig = write_listing(perm, paths, paths_head, paths_count);
+    if (apply.s) {
+        // Edits come from a file, so the temp file is never used
+        os_remove_temp_file(perm->ctx);
+    } else if (list_out.s) {
+        os_remove_temp_file(perm->ctx);
+        if (!os_write_file(perm->ctx, *perm, list_out, orig.text)) {
+            prints8(err, S("vidir: failed to write listing: "));
+            prints8(err, list_out);
+            prints8(err, S("\n"));
+            flush(err);
+            os_exit(perm->ctx, 1);
         }
-        
-        if (s8equals(basename, S(".")) || s8equals(basename, S(".."))) {
-            continue;
+    } else {
+        write_temp_file(perm->ctx, orig.text);
+        // Close temp file so editor can open it
+        os_close_temp_file(perm->ctx);
+    }
+
+    now = os_clock(perm->ctx);
+    st.ns[PHASE_WRITE] = now - phase_start;
+    st.bytes[PHASE_WRITE] = perm->beg - phase_mark;
+    phase_start = now;
+
+    s8 edited = {0};
+    if (apply.s) {
+        // Beside --apply, --list-out names the listing that was edited
+        s8 listed = os_read_file(perm->ctx, perm, list_out);
+        if (!listed.s || !s8equals(listed, orig.text)) {
+            prints8(err, S("vidir: listing does not match the current files: "));
+            prints8(err, list_out);
+            prints8(err, S("\n"));
+            flush(err);
+            os_exit(perm->ctx, 1);
+        }
+        edited = os_read_file(perm->ctx, perm, apply);
+        if (!edited.s) {
+            prints8(err, S("vidir: failed to read edited listing: "));
+            prints8(err, apply);
+            prints8(err, S("\n"));
+            flush(err);
+            os_exit(perm->ctx, 1);
+        }
+    } else if (!list_out.s) {
+        arena scratch = *perm;
+        b32 editor_success = os_invoke_editor(perm->ctx, scratch);
+        if (!editor_success) {
+            prints8(err, S("vidir: failed to invoke editor\n"));
+            flush(err);
+            return;
         }
-        
-        s8 display = prepend_dot_slash(perm, path);
-        original_names[original_name_count] = display;
-        original_name_count++;
-        
-        printi64(tmp, original_name_count);
-        prints8(tmp, S("\t"));
-        prints8(tmp, display);
-        prints8(tmp, S("\n"));
     }
+
+    now = os_clock(perm->ctx);
+    st.ns[PHASE_EDITOR] = now - phase_start;
+    phase_start = now;
+    phase_mark = perm->beg;
     
-    flush(tmp);
-    
-    // Close temp file so editor can open it
-    os_close_temp_file(perm->ctx);
-    
-    arena scratch = *perm;
-    b32 editor_success = os_invoke_editor(perm->ctx, scratch);
-    if (!editor_success) {
-        prints8(err, S("vidir: failed to invoke editor\n"));
+    // Only listed, or left exactly as written, so there is nothing to do
+    if (!list_out.s) {
+        edited = os_map_temp_file(perm->ctx, perm);
+    }
+    if (!edited.s || s8equals(edited, orig.text)) {
+        os_remove_temp_file(perm->ctx);
+        if (show_stats) {
+            st.ns[PHASE_PARSE] = os_clock(perm->ctx) - phase_start;
+            st.peak = perm->beg - arena_start;
+            print_stats(err, &st, (Plan){0}, os_counters(perm->ctx), orig.len);
+        }
         flush(err);
         return;
     }
-    
-    // Reopen temp file for reading
-    os_open_temp_file(perm->ctx);
-    
+
     // Parse the temp file into the new names array
-    s8 *new_names = parse_temp_file(perm, input, original_name_count, err);
+    changes ch = parse_temp_file(perm, paths, &orig, edited, err);
+
+    now = os_clock(perm->ctx);
+    st.ns[PHASE_PARSE] = now - phase_start;
+    st.bytes[PHASE_PARSE] = perm->beg - phase_mark;
+    phase_start = now;
+    phase_mark = perm->beg;
     
     // Compute the plan
-    Plan plan = compute_plan(perm, original_names, new_names, original_name_count);
+    Plan plan = compute_plan(perm, paths, &orig, ch);
+
+    now = os_clock(perm->ctx);
+    st.ns[PHASE_PLAN] = now - phase_start;
+    st.bytes[PHASE_PLAN] = perm->beg - phase_mark;
+    phase_start = now;
     
     // Execute the plan
-    scratch = *perm;
+    arena scratch = *perm;
     scratch.beg = perm->beg;  // Start scratch from current position, don't overlap permanent data
-    b32 success = execute_plan(plan, scratch, perm->ctx, out, err, verbose);
+    execopts opts = {0};
+    opts.verbose = verbose;
+    opts.batch = batch;
+    opts.jobs = jobs;
+    if (journal.s) {
+        if (!os_open_journal(perm->ctx, scratch, journal, 1)) {
+            prints8(err, S("vidir: failed to create journal: "));
+            prints8(err, journal);
+            prints8(err, S("\n"));
+            flush(err);
+            os_exit(perm->ctx, 1);
+        }
+        opts.journal = JOURNAL_NEW;
+    }
+    b32 success = execute_plan(plan, scratch, perm->ctx, out, err, opts, &st);
+    st.ns[PHASE_EXECUTE] = os_clock(perm->ctx) - phase_start;
     
     os_remove_temp_file(perm->ctx);
-    
-#ifdef PRINT_MEMUSAGE
-    iz memory_used = perm->beg - arena_start;
-    iz avg_per_file = memory_used / original_name_count;
-    prints8(err, S("vidir: used "));
-    printi64(err, (i64)memory_used);
-    prints8(err, S(" bytes total ("));
-    printi64(err, (i64)avg_per_file);
-    prints8(err, S(" bytes per file, "));
-    printi64(err, (i64)original_name_count);
-    prints8(err, S(" files)\n"));
-#endif
+
+    if (show_stats) {
+        st.peak = perm->beg - arena_start + st.bytes[PHASE_EXECUTE];
+        flush(out);
+        print_stats(err, &st, plan, os_counters(perm->ctx), orig.len);
+    }
 
     flush(out);
     flush(err);